@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 
@@ -32,10 +33,12 @@
 #include "usart.h"
 #include "sc16is7xx.h"
 #include "onewire.h"
+#include "ds2482.h"
 #include "ds18x20.h"
 #include "i2c.h"
 #include "adc.h"
 #include "gsm.h"
+#include "crc8.h"
 
 #define CMD_NONE              0x00
 #define CMD_READLINE          0x01
@@ -80,6 +83,14 @@
 #define PARAM_U16H            10
 #define PARAM_DESC            11
 #define PARAM_PHONENUMBER     12
+#define PARAM_U8_1DP_HYST     13
+#define PARAM_APN             14
+#define PARAM_URL             15
+#define PARAM_U8_RES          16
+#define PARAM_U8_FILTER       17
+
+/* Won't compile if the configuration outgrows the EEPROM. See MAX_SENSORS in project.h. SRAM is checked at link time */
+typedef char config_fits_eeprom_t[(sizeof(sys_config_t) <= (E2END + 1)) ? 1 : -1];
 
 static int8_t get_line(char *str, int8_t max, uint8_t *ignore_lf);
 static bool parse_param(void *param, uint8_t type, char *arg);
@@ -91,7 +102,6 @@ static int8_t sms_recipient_prompt_handler(char *text, recipient_config_t *recip
 static void do_show_temp_sensor(tempsensor_config_t *sensorconfig, int8_t index, bool sms);
 static void default_tempsensor(tempsensor_config_t *sensorconfig);
 static int8_t temp_sensor_prompt_handler(char *text, tempsensor_config_t *sensorconfig, bool sms, bool *needs_save);
-static void save_configuration(sys_config_t *config);
 static void default_configuration(sys_config_t *config);
 static bool do_i2c_read_reg(char *args);
 static bool do_i2c_read_reg16(char *args);
@@ -101,11 +111,15 @@ static bool do_i2c_write_reg16(char *args);
 static void do_battery(bool sms);
 static void do_modem(void);
 static void do_readtemp(void);
+#ifdef _OW_DS2482_
+static void do_bus_errors(bool sms);
+#endif /* _OW_DS2482_ */
 
 uint8_t _g_max_history;
 uint8_t _g_show_history;
 uint8_t _g_next_history;
 char _g_cmd_history[CMD_MAX_HISTORY][CMD_MAX_LINE];
+uint8_t _g_sensors_changed[SENSOR_SET_BYTES];  /* Set by SMS. Main pushes TH/TL and resolution to the sensor */
 
 void configuration_bootprompt(sys_config_t *config)
 {
@@ -168,11 +182,32 @@ static void do_show(sys_config_t *config)
 {
     printf("\r\nCurrent configuration:\r\n\r\n"
             "\tresenddelay ..........: %u\r\n"
+            "\tsmsperhour ...........: %u\r\n"
+            "\tsmsperday ............: %u\r\n"
+            "\tescalation ...........: %u\r\n"
+            "\ttelemetry ............: %u\r\n"
             "\texpectedsensors ......: %u\r\n",
             config->resend_delay,
+            config->sms_per_hour,
+            config->sms_per_day,
+            config->escalation,
+            config->telemetry_interval,
             config->expected_sensors
         );
 
+#ifdef _GSM_GPRS_
+    printf(
+            "\tapn ..................: %s\r\n"
+            "\turl ..................: %s\r\n"
+            "\tgprssample ...........: %u\r\n"
+            "\tgprsupload ...........: %u\r\n",
+            config->gprs_apn,
+            config->gprs_url,
+            config->gprs_sample,
+            config->gprs_upload
+        );
+#endif /* _GSM_GPRS_ */
+
     printf("\r\n");
 }
 
@@ -182,6 +217,14 @@ static void do_help(void)
         "\r\nCommands:\r\n\r\n"
         "\tresenddelay [1 to 65535]\r\n"
         "\t\tDelay to re-notify fault conditions (seconds)\r\n\r\n"
+        "\tsmsperhour [0 to 255]\r\n"
+        "\tsmsperday [0 to 255]\r\n"
+        "\t\tMaximum alerts sent per hour and per day. 0 for no limit\r\n\r\n"
+        "\tescalation [0 to 255]\r\n"
+        "\t\tAlert one recipient at a time, moving to the next if there's no 'ack'\r\n"
+        "\t\treply within this many minutes. 0 to alert all recipients at once\r\n\r\n"
+        "\ttelemetry [0 to 65535]\r\n"
+        "\t\tMinutes between telemetry reports to telemetry recipients. 0 to disable\r\n\r\n"
         "\texpectedsensors [1 to %u]\r\n"
         "\t\tNumber of temperature sensors which should be attached\r\n\r\n"
         "\ttempsensor [1 to %u]\r\n"
@@ -200,6 +243,8 @@ static void do_help(void)
         "\t\tConnect this terminal to GSM modem for manual command entry\r\n\r\n"
         "\treadtemp\r\n"
         "\t\tShow attached 1-wire temperature sensors\r\n\r\n"
+        "\tbuserrors\r\n"
+        "\t\tShow I2C and 1-wire error counts for each bus\r\n\r\n"
         "\tshow\r\n"
         "\t\tShow current configuration\r\n\r\n"
         "\tdefault\r\n"
@@ -211,6 +256,25 @@ static void do_help(void)
         "\treset\r\n"
         "\t\tPerform a hard reset\r\n\r\n"
         , MAX_SENSORS, MAX_SENSORS, MAX_RECIPIENTS);
+
+#ifdef _GSM_GPRS_
+    printf(
+        "\tapn [name]\r\n"
+        "\t\tGPRS access point name (%u chars max)\r\n\r\n"
+        "\turl [http://...]\r\n"
+        "\t\tURL telemetry is POSTed to (%u chars max)\r\n\r\n"
+        "\tgprssample [0 to 65535]\r\n"
+        "\t\tSeconds between telemetry samples buffered for upload\r\n\r\n"
+        "\tgprsupload [0 to 65535]\r\n"
+        "\t\tMinutes between uploads of buffered telemetry. 0 to disable\r\n\r\n"
+        , MAX_APN - 1, MAX_URL - 1);
+#endif /* _GSM_GPRS_ */
+
+#ifdef _CRC8_BENCHMARK_
+    printf(
+        "\tcrcbench\r\n"
+        "\t\tTime the CRC8 implementations\r\n\r\n");
+#endif /* _CRC8_BENCHMARK_ */
 }
 
 static void do_tempsensor_help(void)
@@ -225,6 +289,19 @@ static void do_tempsensor_help(void)
         "\t\tSets the threshold for the low temperature alert\r\n\r\n"
         "\thighthreshold [-55.0 to 125.0]\r\n"
         "\t\tSets the threshold for the high temperature alert\r\n\r\n"
+        "\thysteresis [0.0 to 25.0]\r\n"
+        "\t\tHow far back past a threshold the temperature must go to clear an alert\r\n\r\n"
+        "\tdwell [0 to 65535]\r\n"
+        "\t\tTime a threshold must stay crossed before the alert state changes (seconds)\r\n\r\n"
+        "\tresolution [9 to 12]\r\n"
+        "\t\tConversion resolution in bits. 10 is 0.25C in a quarter of the time of 12\r\n"
+        "\t\tWritten to the sensor at startup\r\n\r\n"
+        "\tfilter [1 to " STRINGIFY(TEMP_FILTER_MAX_DEPTH) "]\r\n"
+        "\t\tReadings in the median filter ahead of the thresholds. 1 turns filtering off\r\n"
+        "\t\tA spike needs more than half of them to raise an alert\r\n\r\n"
+        "\tunbind\r\n"
+        "\t\tFor a sensor which has been removed. Forgets its ROM code, and the next new sensor\r\n"
+        "\t\tfound takes its place. A sensor still on the bus is bound again\r\n\r\n"
         "\tshow\r\n"
         "\t\tShow current configuration for this sensor\r\n\r\n"
         "\tdefault\r\n"
@@ -242,9 +319,12 @@ static void do_sms_recipient_help(void)
         "\t\tSets the phone number of the recipient\r\n"
         "\t\tCan be +XX or 0XX format (%u chars max)\r\n\r\n"
         "\tnotify [0 or 1]\r\n"
-        "\t\tIf set to 1 this number will receive alerts\r\n\r\n"
+        "\t\tIf set to 1 this number will receive alerts\r\n"
+        "\t\tRecipients are alerted in order when escalation is enabled\r\n\r\n"
         "\tadmin [0 or 1]\r\n"
         "\t\tIf set to 1 this number can send configuration messages\r\n\r\n"
+        "\ttelemetry [0 or 1]\r\n"
+        "\t\tIf set to 1 this number will receive periodic telemetry reports\r\n\r\n"
         "\tshow\r\n"
         "\t\tShow current configuration for this sensor\r\n\r\n"
         "\tdefault\r\n"
@@ -268,6 +348,48 @@ int8_t configuration_prompt_handler(char *text, sys_config_t *config, bool sms)
             return 1;
         needs_save = true;
     }
+    else if (!stricmp(command, "smsperhour")) {
+        if (!parse_param(&config->sms_per_hour, PARAM_U8, arg))
+            return 1;
+        needs_save = true;
+    }
+    else if (!stricmp(command, "smsperday")) {
+        if (!parse_param(&config->sms_per_day, PARAM_U8, arg))
+            return 1;
+        needs_save = true;
+    }
+    else if (!stricmp(command, "escalation")) {
+        if (!parse_param(&config->escalation, PARAM_U8, arg))
+            return 1;
+        needs_save = true;
+    }
+    else if (!stricmp(command, "telemetry")) {
+        if (!parse_param(&config->telemetry_interval, PARAM_U16, arg))
+            return 1;
+        needs_save = true;
+    }
+#ifdef _GSM_GPRS_
+    else if (!stricmp(command, "apn")) {
+        if (!parse_param(config->gprs_apn, PARAM_APN, arg))
+            return 1;
+        needs_save = true;
+    }
+    else if (!stricmp(command, "url")) {
+        if (!parse_param(config->gprs_url, PARAM_URL, arg))
+            return 1;
+        needs_save = true;
+    }
+    else if (!stricmp(command, "gprssample")) {
+        if (!parse_param(&config->gprs_sample, PARAM_U16, arg))
+            return 1;
+        needs_save = true;
+    }
+    else if (!stricmp(command, "gprsupload")) {
+        if (!parse_param(&config->gprs_upload, PARAM_U16, arg))
+            return 1;
+        needs_save = true;
+    }
+#endif /* _GSM_GPRS_ */
     else if (!stricmp(command, "expectedsensors")) {
         if (!parse_param(&config->expected_sensors, PARAM_U8_SIDX, arg))
             return 1;
@@ -323,6 +445,20 @@ int8_t configuration_prompt_handler(char *text, sys_config_t *config, bool sms)
     else if (!stricmp(command, "battery")) {
         do_battery(sms);
     }
+#ifdef _OW_DS2482_
+    else if (!stricmp(command, "buserrors")) {
+        do_bus_errors(sms);
+    }
+#endif /* _OW_DS2482_ */
+#ifdef _CRC8_BENCHMARK_
+    else if (!stricmp(command, "crcbench")) {
+
+        if (sms)
+            return 1;
+
+        crc8_benchmark();
+    }
+#endif /* _CRC8_BENCHMARK_ */
     else if (!stricmp(command, "modem")) {
         do_modem();
     }
@@ -335,9 +471,16 @@ int8_t configuration_prompt_handler(char *text, sys_config_t *config, bool sms)
         p--;
 
         if (!sms)
+        {
             temp_sensor_prompt(&config->temp_sensors[p], p);
+        }
         else
-            temp_sensor_prompt_handler(strtok(NULL, ""), &config->temp_sensors[p], sms, &needs_save);        
+        {
+            temp_sensor_prompt_handler(strtok(NULL, ""), &config->temp_sensors[p], sms, &needs_save);
+
+            if (needs_save)
+                bitset_set(_g_sensors_changed, p);
+        }
     }
     else if (!stricmp(command, "recipient") || !stricmp(command, "user")) {
         char *p1 = strtok(arg, " ");
@@ -417,57 +560,76 @@ int8_t configuration_prompt_handler(char *text, sys_config_t *config, bool sms)
 
 static void do_readtemp(void)
 {
-    uint8_t i;
+    ds18x20_search_t search;
     uint8_t num_sensors;
-    uint8_t sensor_ids[MAX_SENSORS][DS18X20_ROMCODE_SIZE];
+    int8_t result;
+    uint8_t bus;
     int16_t reading;
     
-    if (ds18x20_search_sensors(&num_sensors, sensor_ids))
-        printf("\r\nFound %u of %u maximum sensors\r\n", num_sensors, MAX_SENSORS);
-    else
-        printf("\r\nHardware error searching for sensors\r\n");
+    for (bus = 0; bus < ow_num_buses(); bus++)
+    {
+        // Everything on the bus converts at once, with the strong pull-up in case
+        // any are parasite powered. Then a search finds each sensor to read.
+        if (!ow_select_bus(bus) || !ds18x20_start_meas_all(true))
+        {
+            printf("\r\nHardware error on bus %u\r\n", bus);
+            continue;
+        }
 
-    if (!num_sensors)
-        goto done;
-    
-    for (i = 0; i < num_sensors; i++)
-        ds18x20_start_meas(sensor_ids[i]);
+        _delay_ms(750);
 
-    _delay_ms(750);
+        printf("\r\nBus %u:\r\n", bus);
 
-    for (i = 0; i < num_sensors; i++)
-    {
-        if (ds18x20_read_decicelsius(sensor_ids[i], &reading))
+        ds18x20_search_start(&search);
+        num_sensors = 0;
+
+        while ((result = ds18x20_search_next(&search)) != DS18X20_SEARCH_DONE)
         {
-            fixedpoint_sign(reading, reading);
-
-            printf(
-                "\r\nSensor %u:\r\n"
-                "\tTemp (C) .............: %s%u.%u\r\n"
-                "\tBurned in ID .........: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X\r\n",
-                i + 1,
-                fixedpoint_arg(reading, reading),
-                sensor_ids[i][0]
+            if (result == DS18X20_SEARCH_ERROR)
+            {
+                printf("\r\nHardware error searching for sensors\r\n");
+                break;
+            }
+
+            if (result != DS18X20_SEARCH_FOUND)
+                continue;
+
+            num_sensors++;
+
+            if (ds18x20_read_temp(search.id, &reading))
+            {
+                reading = temp_to_decicelsius(reading);
+                fixedpoint_sign(reading, reading);
+
+                printf(
+                    "\r\nSensor %u:\r\n"
+                    "\tTemp (C) .............: %s%u.%u\r\n"
+                    "\tBurned in ID .........: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X\r\n",
+                    num_sensors,
+                    fixedpoint_arg(reading, reading),
+                    search.id[0]
 #if DS18X20_ROMCODE_SIZE == 8
-              , sensor_ids[i][1],
-                sensor_ids[i][2],
-                sensor_ids[i][3],
-                sensor_ids[i][4],
-                sensor_ids[i][5],
-                sensor_ids[i][6],
-                sensor_ids[i][7]
+                  , search.id[1],
+                    search.id[2],
+                    search.id[3],
+                    search.id[4],
+                    search.id[5],
+                    search.id[6],
+                    search.id[7]
 #else
-              , 0, 0, 0, 0, 0, 0, 0
+                  , 0, 0, 0, 0, 0, 0, 0
 #endif /* DS18X20_ROMCODE_SIZE == 8 */
-            );
-        }
-        else
-        {
-            printf("Failed to read sensor %u\r\n", i + 1);
+                );
+            }
+            else
+            {
+                printf("Failed to read sensor %u\r\n", num_sensors);
+            }
         }
+
+        printf("\r\nFound %u sensors on bus %u\r\n", num_sensors, bus);
     }
     
-done:
     printf("\r\n");
 }
 
@@ -494,6 +656,11 @@ static int8_t sms_recipient_prompt_handler(char *text, recipient_config_t *recip
             return 1;
         *needs_save = true;
     }
+    else if (!stricmp(command, "telemetry")) {
+        if (!parse_param(&recipientconfig->telemetry, PARAM_U8_BIT, arg))
+            return 1;
+        *needs_save = true;
+    }
     else if (!stricmp(command, "show")) {
         do_show_sms_recipient(recipientconfig, -1, sms);
         return 0;
@@ -532,19 +699,22 @@ static void do_show_sms_recipient(recipient_config_t *recipientconfig, int8_t in
         printf(
             "\tnumber ...............: %s\r\n"
             "\tnotify ...............: %u\r\n"
-            "\tadmin ................: %u\r\n\r\n",
+            "\tadmin ................: %u\r\n"
+            "\ttelemetry ............: %u\r\n\r\n",
             recipientconfig->number,
             recipientconfig->notify,
-            recipientconfig->admin
+            recipientconfig->admin,
+            recipientconfig->telemetry
         );
     }
     else
     {
         sms_respond_to_source(
-            "Number: %s\nNotify: %u\nAdmin: %u",
+            "Number: %s\nNotify: %u\nAdmin: %u\nTelemetry: %u",
             recipientconfig->number,
             recipientconfig->notify,
-            recipientconfig->admin
+            recipientconfig->admin,
+            recipientconfig->telemetry
         );    
     }
 }
@@ -584,6 +754,7 @@ static void default_sms_recipient(recipient_config_t *recipientconfig)
     recipientconfig->number[0] = 0;
     recipientconfig->notify = 0;
     recipientconfig->admin = 0;
+    recipientconfig->telemetry = 0;
 }
 
 static int8_t temp_sensor_prompt_handler(char *text, tempsensor_config_t *sensorconfig, bool sms, bool *needs_save)
@@ -614,6 +785,34 @@ static int8_t temp_sensor_prompt_handler(char *text, tempsensor_config_t *sensor
             return 1;
         *needs_save = true;
     }
+    else if (!stricmp(command, "hysteresis") || !stricmp(command, "hyst")) {
+        if (!parse_param(&sensorconfig->hysteresis, PARAM_U8_1DP_HYST, arg))
+            return 1;
+        *needs_save = true;
+    }
+    else if (!stricmp(command, "dwell")) {
+        if (!parse_param(&sensorconfig->dwell, PARAM_U16, arg))
+            return 1;
+        *needs_save = true;
+    }
+    else if (!stricmp(command, "resolution") || !stricmp(command, "res")) {
+        if (!parse_param(&sensorconfig->resolution, PARAM_U8_RES, arg))
+            return 1;
+        *needs_save = true;
+    }
+    else if (!stricmp(command, "filter")) {
+        if (!parse_param(&sensorconfig->filter, PARAM_U8_FILTER, arg))
+            return 1;
+        *needs_save = true;
+    }
+    else if (!stricmp(command, "unbind")) {
+        // Main drops the sensor when it sees the ROM code gone. Anything still on the bus comes back.
+        memset(sensorconfig->rom, 0, DS18X20_ROMCODE_SIZE);
+        *needs_save = true;
+
+        if (!sms)
+            printf("Slot freed. Remove the sensor first or it will be bound again\r\n");
+    }
     else if (!stricmp(command, "show")) {
         do_show_temp_sensor(sensorconfig, -1, sms);
         return 0;
@@ -644,9 +843,13 @@ static void do_show_temp_sensor(tempsensor_config_t *sensorconfig, int8_t index,
 {
     char low_threshold_buf[MAX_FDP];
     char high_threshold_buf[MAX_FDP];
+    char hysteresis_buf[MAX_FDP];
+    char rom_buf[(DS18X20_ROMCODE_SIZE * 2) + 1];
 
     format_i16_1dp(low_threshold_buf, sensorconfig->low_threshold);
     format_i16_1dp(high_threshold_buf, sensorconfig->high_threshold);
+    format_u16_1dp(hysteresis_buf, sensorconfig->hysteresis);
+    format_hex(rom_buf, sensorconfig->rom, DS18X20_ROMCODE_SIZE);
 
     if (!sms)
     {
@@ -659,20 +862,38 @@ static void do_show_temp_sensor(tempsensor_config_t *sensorconfig, int8_t index,
             "\tname .................: %s\r\n"
             "\tnotify ...............: %u\r\n"
             "\tlowthreshold .........: %s\r\n"
-            "\thighthreshold ........: %s\r\n\r\n",
+            "\thighthreshold ........: %s\r\n"
+            "\thysteresis ...........: %s\r\n"
+            "\tdwell ................: %u\r\n"
+            "\tresolution ...........: %u\r\n"
+            "\tfilter ...............: %u\r\n"
+            "\tbus ..................: %u\r\n"
+            "\trom ..................: %s\r\n\r\n",
             sensorconfig->name,
             sensorconfig->notify,
             low_threshold_buf,
-            high_threshold_buf
+            high_threshold_buf,
+            hysteresis_buf,
+            sensorconfig->dwell,
+            sensorconfig->resolution,
+            sensorconfig->filter,
+            sensorconfig->bus,
+            rom_buf
         );
     }
     else
     {
-        sms_respond_to_source("Name: %s\nNotify: %u\nLowThreshold: %s\nHighThreshold: %s",
+        sms_respond_to_source("Name: %s\nNotify: %u\nLowThreshold: %s\nHighThreshold: %s\nHysteresis: %s\nDwell: %u\nResolution: %u\nFilter: %u\nBus: %u\nRom: %s",
             sensorconfig->name,
             sensorconfig->notify,
             low_threshold_buf,
-            high_threshold_buf
+            high_threshold_buf,
+            hysteresis_buf,
+            sensorconfig->dwell,
+            sensorconfig->resolution,
+            sensorconfig->filter,
+            sensorconfig->bus,
+            rom_buf
         );
     }
 }
@@ -713,6 +934,12 @@ static void default_tempsensor(tempsensor_config_t *sensorconfig)
     sensorconfig->notify = 1;
     sensorconfig->low_threshold = 150;
     sensorconfig->high_threshold = 300;
+    sensorconfig->hysteresis = 10;
+    sensorconfig->dwell = 10;
+    sensorconfig->resolution = 12;
+    sensorconfig->filter = 3;
+    sensorconfig->bus = 0;
+    memset(sensorconfig->rom, 0, DS18X20_ROMCODE_SIZE);
 }
 
 static bool do_i2c_read_reg(char *args)
@@ -884,6 +1111,46 @@ static void do_battery(bool sms)
         sms_respond_to_source("Battery: %u.%02u V\n(Full: 4.15 V)\n(Empty: 3.20 V)", fixedpoint_arg_u_2dp(battery_voltage));
 }
 
+#ifdef _OW_DS2482_
+static void do_bus_errors(bool sms)
+{
+    uint16_t total[DS2482_NUM_ERRS];
+    uint16_t count;
+    uint8_t bus;
+    uint8_t err;
+
+    memset(total, 0, sizeof(total));
+
+    if (!sms)
+        printf("\r\nBus    NACK   Arb    Tmout  1WB    Short  CRC\r\n");
+
+    for (bus = 0; bus < ds2482_num_buses(); bus++)
+    {
+        if (!sms)
+            printf("%-7u", bus);
+
+        for (err = 0; err < DS2482_NUM_ERRS; err++)
+        {
+            count = ds2482_error_count(bus, err);
+            total[err] += count;
+
+            if (!sms)
+                printf("%-7u", count);
+        }
+
+        if (!sms)
+            printf("\r\n");
+    }
+
+    if (!sms)
+        printf("\r\n");
+    else
+        sms_respond_to_source("Bus errors\nNACK: %u\nArb lost: %u\nTimeout: %u\n1WB: %u\nShort: %u\nCRC: %u",
+            total[DS2482_ERR_NACK], total[DS2482_ERR_ARB_LOST], total[DS2482_ERR_TIMEOUT],
+            total[DS2482_ERR_1WB], total[DS2482_ERR_SHORT], total[DS2482_ERR_CRC]);
+}
+#endif /* _OW_DS2482_ */
+
 static void do_modem(void)
 {
     printf(
@@ -928,12 +1195,18 @@ static bool parse_param(void *param, uint8_t type, char *arg)
 
     switch (type)
     {
+        case PARAM_U8:
         case PARAM_U8_PCT:
         case PARAM_U8_BIT:
         case PARAM_U8_SIDX:
         case PARAM_U8_RIDX:
         case PARAM_U8_TCNT:
-            if (*arg == '-')
+        case PARAM_U8_RES:
+        case PARAM_U8_FILTER:
+            // Not a number would be 0, and 256 would wrap to 0. Either turns some settings off
+            if (*arg < '0' || *arg > '9')
+                return false;
+            if (strtoul(arg, NULL, 10) > UINT8_MAX)
                 return false;
             u8param = (uint8_t)atoi(arg);
             if (type == PARAM_U8_BIT && u8param > 1)
@@ -942,6 +1215,10 @@ static bool parse_param(void *param, uint8_t type, char *arg)
                 return false;
             if (type == PARAM_U8_TCNT && u8param > 6)
                 return false;
+            if (type == PARAM_U8_RES && (u8param < 9 || u8param > 12))
+                return false;
+            if (type == PARAM_U8_FILTER && (u8param < 1 || u8param > TEMP_FILTER_MAX_DEPTH))
+                return false;
             if (type == PARAM_U8_SIDX && (u8param > MAX_SENSORS || u8param < 1))
                 return false;
             if (type == PARAM_U8_RIDX && (u8param > MAX_RECIPIENTS || u8param < 1))
@@ -955,6 +1232,7 @@ static bool parse_param(void *param, uint8_t type, char *arg)
         case PARAM_I16_1DP_TEMP:
         case PARAM_U16:
         case PARAM_U16_1DP_TEMPMAX:
+        case PARAM_U8_1DP_HYST:
             s = strtok(arg, ".");
             i16param = atoi(s);
             switch (type)
@@ -967,6 +1245,7 @@ static bool parse_param(void *param, uint8_t type, char *arg)
                     dp = 1;
                     break;
                 case PARAM_U16_1DP_TEMPMAX:
+                case PARAM_U8_1DP_HYST:
                     i16param *= _1DP_BASE;
                     dp = 1;
                     un = 1;
@@ -1001,6 +1280,13 @@ static bool parse_param(void *param, uint8_t type, char *arg)
                 if (i16param > 1800)
                     i16param = 1800;
             }
+            if (type == PARAM_U8_1DP_HYST)
+            {
+                if (i16param > 250)
+                    i16param = 250;
+                *(uint8_t *)param = (uint8_t)i16param;
+                break;
+            }
             *(int16_t *)param = i16param;
             break;
         case PARAM_U16H:
@@ -1012,6 +1298,20 @@ static bool parse_param(void *param, uint8_t type, char *arg)
             strncpy(sparam, arg, MAX_DESC);
             sparam[MAX_DESC - 1] = 0;
             break;
+#ifdef _GSM_GPRS_
+        case PARAM_APN:
+            sparam = (char *)param;
+            strncpy(sparam, arg, MAX_APN);
+            sparam[MAX_APN - 1] = 0;
+            break;
+        case PARAM_URL:
+            if (strncmp_p(arg, "http://", 7))
+                return false;
+            sparam = (char *)param;
+            strncpy(sparam, arg, MAX_URL);
+            sparam[MAX_URL - 1] = 0;
+            break;
+#endif /* _GSM_GPRS_ */
         case PARAM_PHONENUMBER:
             {
                 char *s = (char *)arg;
@@ -1258,13 +1558,6 @@ static int8_t get_line(char *str, int8_t max, uint8_t *ignore_lf)
 
 void load_configuration(sys_config_t *config)
 {
-    uint16_t config_size = sizeof(sys_config_t);
-    if (config_size > 0x100)
-    {
-        printf("\r\nConfiguration size is too large. Currently %u bytes.", config_size);
-        reset();
-    }
-    
     eeprom_read_data(0, (uint8_t *)config, sizeof(sys_config_t));
 
     if (config->magic != CONFIG_MAGIC)
@@ -1282,6 +1575,16 @@ static void default_configuration(sys_config_t *config)
     config->magic = CONFIG_MAGIC;
     config->expected_sensors = 0;
     config->resend_delay = 300;
+    config->sms_per_hour = 10;
+    config->sms_per_day = 40;
+    config->escalation = 0;
+    config->telemetry_interval = 0;
+#ifdef _GSM_GPRS_
+    config->gprs_apn[0] = 0;
+    config->gprs_url[0] = 0;
+    config->gprs_sample = 600;
+    config->gprs_upload = 60;
+#endif /* _GSM_GPRS_ */
 
     for (i = 0; i < MAX_SENSORS; i++)
         default_tempsensor(&config->temp_sensors[i]);
@@ -1290,7 +1593,7 @@ static void default_configuration(sys_config_t *config)
         default_sms_recipient(&config->sms_recipients[i]);
 }
 
-static void save_configuration(sys_config_t *config)
+void save_configuration(sys_config_t *config)
 {
     eeprom_write_data(0, (uint8_t *)config, sizeof(sys_config_t));
 }
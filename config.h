@@ -24,13 +24,20 @@
 typedef struct {
     int16_t low_threshold;
     int16_t high_threshold;
+    uint8_t hysteresis;
+    uint16_t dwell;
     uint8_t notify;
+    uint8_t resolution;
+    uint8_t filter;
+    uint8_t bus;
+    uint8_t rom[DS18X20_ROMCODE_SIZE]; /* All zero when not bound */
     char name[MAX_DESC];
 } tempsensor_config_t;
 
 typedef struct {
     uint8_t notify;
     uint8_t admin;
+    uint8_t telemetry;
     char number[MAX_RECIPIENT];
 } recipient_config_t;
 
@@ -38,12 +45,25 @@ typedef struct {
     uint16_t magic;
     uint8_t expected_sensors;
     uint16_t resend_delay;
+    uint8_t sms_per_hour;
+    uint8_t sms_per_day;
+    uint8_t escalation;
+    uint16_t telemetry_interval;
+#ifdef _GSM_GPRS_
+    char gprs_apn[MAX_APN];
+    char gprs_url[MAX_URL];
+    uint16_t gprs_sample;
+    uint16_t gprs_upload;
+#endif /* _GSM_GPRS_ */
     tempsensor_config_t temp_sensors[MAX_SENSORS];
     recipient_config_t sms_recipients[MAX_RECIPIENTS];
 } sys_config_t;
 
 void configuration_bootprompt(sys_config_t *config);
 void load_configuration(sys_config_t *config);
+void save_configuration(sys_config_t *config);
 int8_t configuration_prompt_handler(char *message, sys_config_t *config, bool sms);
 
+extern uint8_t _g_sensors_changed[SENSOR_SET_BYTES];
+
 #endif /* __CONFIG_H__ */
\ No newline at end of file
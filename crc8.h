@@ -1,6 +1,20 @@
 #ifndef CRC8_H_
 #define CRC8_H_
 
-uint8_t crc8(uint8_t* dat, uint16_t number_of_bytes_in_data);
+#if defined(_CRC8_TABLE_)
+#define crc8(dat, n) crc8_table(dat, n)
+#elif defined(_CRC8_NIBBLE_)
+#define crc8(dat, n) crc8_nibble(dat, n)
+#else
+#define crc8(dat, n) crc8_bitwise(dat, n)
+#endif
+
+uint8_t crc8_bitwise(uint8_t* dat, uint16_t number_of_bytes_in_data);
+uint8_t crc8_table(uint8_t* dat, uint16_t number_of_bytes_in_data);
+uint8_t crc8_nibble(uint8_t* dat, uint16_t number_of_bytes_in_data);
+
+#ifdef _CRC8_BENCHMARK_
+void crc8_benchmark(void);
+#endif /* _CRC8_BENCHMARK_ */
 
 #endif
@@ -18,14 +18,17 @@
 
 #include "project.h"
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <util/delay.h>
 
 #include "config.h"
 #include "onewire.h"
 #include "ds18x20.h"
 #include "ds2482.h"
 #include "crc8.h"
+#include "util.h"
 
 #define OW_SEARCH_FIRST           0xFF
 #define OW_PRESENCE_ERR           0xFF
@@ -40,6 +43,13 @@
 #define DS18X20_SP_SIZE           9
 #define DS18X20_READ              0xBE
 #define DS18X20_CONVERT_T         0x44
+#define DS18X20_WRITE             0x4E
+#define DS18X20_COPY              0x48
+#define DS18X20_READ_POWER        0xB4
+#define DS18X20_TCOPY             10      /* ms */
+
+#define DS18B20_TH_REG            2
+#define DS18B20_TL_REG            3
 
 #define DS18B20_CONF_REG          4
 #define DS18B20_9_BIT             0
@@ -47,48 +57,58 @@
 #define DS18B20_11_BIT            (1 << 6)
 #define DS18B20_12_BIT            ((1 << 6) | (1 << 5))
 #define DS18B20_RES_MASK          ((1 << 6) | (1 << 5))
+#define DS18B20_RES_SHIFT         5
+#define DS18B20_CONF_FIXED        (1 << 7)  /* Always 0 on a DS18B20/DS1822 */
 #define DS18B20_9_BIT_UNDF        ((1 << 0) | (1 << 1) | (1 << 2))
 #define DS18B20_10_BIT_UNDF       ((1 << 0) | (1 << 1))
 #define DS18B20_11_BIT_UNDF       ((1 << 0))
 #define DS18B20_12_BIT_UNDF       0
 
-#define DS18X20_INVALID_DECICELSIUS  2000
+#define DS18X20_INVALID_TEMP         0x7FFF
+#define DS18X20_CRC_RETRIES          1      /* A glitch shouldn't cost a reading */
+
+#ifdef _DS2482_ASYNC_
+static void (*_g_read_callback)(bool success, int16_t temp, void *data);
+static uint8_t *_g_read_id;
+static uint8_t _g_read_retries;
+
+static bool ds18x20_read_start(void *data);
+static void ds18x20_read_done(bool success, void *data);
+#endif /* _DS2482_ASYNC_ */
 
 static bool ds18x20_read_scratchpad(uint8_t *id, uint8_t *sp, uint8_t n)
 {
+    uint8_t tries = DS18X20_CRC_RETRIES + 1;
     uint8_t i;
 
-#ifdef _DS18X20_SINGLE_DEV_PER_CHANNEL_
-    if (!ow_select_channel(*id))
-        return false;
-#endif /* _DS18X20_SINGLE_DEV_PER_CHANNEL_ */
-
-#ifdef _DS18X20_SINGLE_DEV_PER_CHANNEL_            
-    if (!ow_command(DS18X20_READ, NULL))    
-#else
-    if (!ow_command(DS18X20_READ, id))    
-#endif /* _DS18X20_SINGLE_DEV_PER_CHANNEL_ */
-        return false;
-
-    for (i = 0; i < n; i++)
+    do
     {
-        if (!ow_read_byte(&sp[i]))
+        if (!ow_command(DS18X20_READ, id))
             return false;
-    }
 
-    if (crc8(sp, DS18X20_SP_SIZE))
-        return false;
+        for (i = 0; i < n; i++)
+        {
+            if (!ow_read_byte(&sp[i]))
+                return false;
+        }
 
-    return true;
+        if (!crc8(sp, DS18X20_SP_SIZE))
+            return true;
+
+        ow_crc_error();
+    } while (--tries);
+
+    return false;
 }
 
-/* Convert scratchpad data to physical value in unit decicelsius */
-static int16_t ds18x20_raw_to_decicelsius(uint8_t familycode, uint8_t *sp)
+/*
+ * Scratchpad to 1/16 degrees C, the native format of a 12 bit reading. It's
+ * two's complement already, so there's nothing to do for a DS18B20 but drop
+ * the bits that are undefined at lower resolutions.
+ */
+static int16_t ds18x20_raw_to_temp(uint8_t familycode, uint8_t *sp)
 {
     uint16_t measure;
-    uint8_t  negative;
-    int16_t  decicelsius;
-    uint16_t fract;
 
     measure = sp[0] | (sp[1] << 8);
 
@@ -99,22 +119,9 @@ static int16_t ds18x20_raw_to_decicelsius(uint8_t familycode, uint8_t *sp)
         measure <<= 3;                 /* Convert to 12-bit, now degrees are in 1/16 degrees units */
         measure += (16 - sp[6]) - 4;   /* Add the compensation and remember to subtract 0.25 degree (4/16) */
     }
-
-    /* Check for negative */
-    if (measure & 0x8000)
-    {
-        negative = 1;       /* Mark negative */
-        measure ^= 0xffff;  /* convert to positive => (twos complement)++ */
-        measure++;
-    }
-    else
-    {
-        negative = 0;
-    }
-
-    /* Clear undefined bits for DS18B20 != 12bit resolution */
-    if (familycode == DS18B20_FAMILY_CODE || familycode == DS1822_FAMILY_CODE)
+    else if (familycode == DS18B20_FAMILY_CODE || familycode == DS1822_FAMILY_CODE)
     {
+        /* Clear undefined bits for DS18B20 != 12bit resolution */
         switch(sp[DS18B20_CONF_REG] & DS18B20_RES_MASK)
         {
         case DS18B20_9_BIT:
@@ -132,28 +139,14 @@ static int16_t ds18x20_raw_to_decicelsius(uint8_t familycode, uint8_t *sp)
         }
     }
 
-    decicelsius = (measure >> 4);
-    decicelsius *= 10;
-
-    /* decicelsius += ((measure & 0x000F) * 640 + 512) / 1024;
-     * 625/1000 = 640/1024
-     */
-    fract = (measure & 0x000F) * 640;
-    if (!negative)
-        fract += 512;
-    fract /= 1024;
-    decicelsius += fract;
-
-    if (negative)
-        decicelsius = -decicelsius;
-
-    if (/* decicelsius == 850 || */ decicelsius < -550 || decicelsius > 1250)
-        return DS18X20_INVALID_DECICELSIUS;
- 
-    return decicelsius;
+    if ((int16_t)measure < TEMP_DEGREES(-55) || (int16_t)measure > TEMP_DEGREES(125))
+        return DS18X20_INVALID_TEMP;
+
+    return (int16_t)measure;
 }
 
-bool ds18x20_read_decicelsius(uint8_t *id, int16_t *decicelsius)
+/* Reads a sensor's last conversion, in 1/16 degrees C */
+bool ds18x20_read_temp(uint8_t *id, int16_t *temp)
 {
     bool presense;
     int16_t ret;
@@ -165,143 +158,223 @@ bool ds18x20_read_decicelsius(uint8_t *id, int16_t *decicelsius)
     if (!ds18x20_read_scratchpad(id, sp, DS18X20_SP_SIZE))
         return false;
 
-    ret = ds18x20_raw_to_decicelsius(id[0], sp);
-    if (ret == DS18X20_INVALID_DECICELSIUS)
+    ret = ds18x20_raw_to_temp(id[0], sp);
+    if (ret == DS18X20_INVALID_TEMP)
         return false;
 
-    *decicelsius = ret;
+    *temp = ret;
     return true;
 }
 
-bool ds18x20_start_meas(uint8_t *id)
+#ifdef _DS2482_ASYNC_
+
+/* Same as ds18x20_read_temp(), but the bus work runs from the main loop */
+bool ds18x20_read_temp_async(uint8_t *id, void (*callback)(bool success, int16_t temp, void *data), void *data)
 {
-    bool presense;
-    
-#ifdef _DS18X20_SINGLE_DEV_PER_CHANNEL_
-    if (!ow_select_channel(*id))
-        return false;
-#endif /* _DS18X20_SINGLE_DEV_PER_CHANNEL_ */
+    _g_read_callback = callback;
+    _g_read_id = id;
+    _g_read_retries = DS18X20_CRC_RETRIES;
 
-    if (!ow_bus_reset(&presense) || !presense)
+    return ds18x20_read_start(data);
+}
+
+static bool ds18x20_read_start(void *data)
+{
+    uint8_t i;
+
+    if (!ds2482_async_begin())
         return false;
 
-    if (ow_bus_idle())
-    {   /* only send if bus is "idle" = high */
-#ifdef _DS18X20_SINGLE_DEV_PER_CHANNEL_
-        if (!ow_command(DS18X20_CONVERT_T, NULL))
-#else
-        if (!ow_command(DS18X20_CONVERT_T, id))
-#endif /* _DS18X20_SINGLE_DEV_PER_CHANNEL_ */
-            return false;
-    }
-    return true;
-}
+    ds2482_async_add(DS2482_OP_RESET, 0);
+    ds2482_async_add(DS2482_OP_WRITE, OW_MATCH_ROM);
+    for (i = 0; i < DS18X20_ROMCODE_SIZE; i++)
+        ds2482_async_add(DS2482_OP_WRITE, _g_read_id[i]);
+    ds2482_async_add(DS2482_OP_WRITE, DS18X20_READ);
+    for (i = 0; i < DS18X20_SP_SIZE; i++)
+        ds2482_async_add(DS2482_OP_READ, 0);
 
-#ifndef _DS18X20_SINGLE_DEV_PER_CHANNEL_
+    return ds2482_async_run(&ds18x20_read_done, data);
+}
 
-bool ds18x20_find_sensor(uint8_t *diff, uint8_t *id)
+static void ds18x20_read_done(bool success, void *data)
 {
-    uint8_t go = 1;
+    uint8_t *sp = ds2482_async_data();
+    int16_t ret;
 
-    do
+    if (success && crc8(sp, DS18X20_SP_SIZE))
     {
-        *diff = ow_rom_search(*diff, id);
-        if (*diff == OW_PRESENCE_ERR || *diff == OW_DATA_ERR || *diff == OW_LAST_DEVICE)
-        {
-            go = 0;
-        }
-        else if (*diff == OW_COMMS_ERR)
-        {
-            return false;
-        }
-        else
+        ow_crc_error();
+
+        // Straight away, rather than lose the reading for this cycle
+        if (_g_read_retries)
         {
-            if (id[0] == DS18B20_FAMILY_CODE || id[0] == DS18S20_FAMILY_CODE ||
-                id[0] == DS1822_FAMILY_CODE)
-            {
-                go = 0;
-            }
+            _g_read_retries--;
+            if (ds18x20_read_start(data))
+                return;
         }
-    } while (go);
 
-    return true;
+        success = false;
+    }
+
+    if (!success)
+    {
+        _g_read_callback(false, 0, data);
+        return;
+    }
+
+    ret = ds18x20_raw_to_temp(_g_read_id[0], sp);
+    _g_read_callback(ret != DS18X20_INVALID_TEMP, ret, data);
 }
 
-bool ds18x20_search_sensors(uint8_t *count, uint8_t(*sensor_ids)[DS18X20_ROMCODE_SIZE])
+#endif /* _DS2482_ASYNC_ */
+
+/*
+ * Writes the resolution (9 to 12 bits) and the TH/TL alarm limits (whole
+ * degrees) to the sensor and copies them to its EEPROM. Skipped if they're
+ * already set, to save EEPROM writes on every boot. On return bits holds the
+ * resolution the sensor is actually running at, which is always 12 for a
+ * DS18S20. A parasite powered sensor needs the strong pull-up for the copy.
+ */
+bool ds18x20_configure(uint8_t *id, uint8_t *bits, int8_t th, int8_t tl, bool parasite)
 {
     bool presense;
-    uint8_t i;
-    uint8_t id[DS18X20_ROMCODE_SIZE];
-    uint8_t diff;
-    
-    *count = 0;
-    
-    if (!ow_bus_reset(&presense))
+    bool fixed;
+    uint8_t conf;
+    uint8_t sp[DS18X20_SP_SIZE];
+
+    if (!ow_bus_reset(&presense) || !presense)
         return false;
-    if (!presense)
+
+    if (!ds18x20_read_scratchpad(id, sp, DS18X20_SP_SIZE))
+        return false;
+
+    /* DS18S20 has no configuration register */
+    fixed = (sp[DS18B20_CONF_REG] & DS18B20_CONF_FIXED) ? true : false;
+
+    if (fixed)
+        *bits = 12;
+
+    conf = ((*bits - 9) << DS18B20_RES_SHIFT) | (sp[DS18B20_CONF_REG] & ~DS18B20_RES_MASK);
+
+    if ((int8_t)sp[DS18B20_TH_REG] == th && (int8_t)sp[DS18B20_TL_REG] == tl &&
+        (fixed || sp[DS18B20_CONF_REG] == conf))
         return true;
-    
-    diff = OW_SEARCH_FIRST;
-    while (diff != OW_LAST_DEVICE && *count < MAX_SENSORS)
-    {
-        if (!ds18x20_find_sensor(&diff, id))
-            return false;
-        
-        if (diff == OW_PRESENCE_ERR)
-            break;
-        if (diff == OW_DATA_ERR)
-            break;
-        for (i = 0; i < DS18X20_ROMCODE_SIZE; i++)
-            sensor_ids[*count][i] = id[i];
-        (*count)++;
-    }
 
-    return true;
-}
+    if (!ow_command(DS18X20_WRITE, id))
+        return false;
+
+    if (!ow_write_byte((uint8_t)th) || !ow_write_byte((uint8_t)tl))
+        return false;
+
+    if (!fixed && !ow_write_byte(conf))
+        return false;
+
+    if (!(parasite ? ow_command_pullup(DS18X20_COPY, id) : ow_command(DS18X20_COPY, id)))
+        return false;
 
-#endif /* !_DS18X20_SINGLE_DEV_PER_CHANNEL_ */
+    _delay_ms(DS18X20_TCOPY);
 
-#ifdef _DS18X20_SINGLE_DEV_PER_CHANNEL_
+    return true;
+}
 
-bool ds18x20_search_sensors(uint8_t *count, uint8_t(*sensor_ids)[DS18X20_ROMCODE_SIZE])
+bool ds18x20_start_meas(uint8_t *id)
 {
     bool presense;
-    uint8_t i;
-    uint8_t id;
 
-    *count = 0;
+    if (!ow_bus_reset(&presense) || !presense)
+        return false;
 
-    for (i = 0; (i < 8) && (*count < MAXSENSORS); i++)
-    {
-        if (!ow_select_channel(i))
-            return false;
-        
-        if (!ow_bus_reset(&presense))
+    if (ow_bus_idle())
+    {   /* only send if bus is "idle" = high */
+        if (!ow_command(DS18X20_CONVERT_T, id))
             return false;
+    }
+    return true;
+}
+
+/*
+ * One SKIP_ROM + CONVERT_T starts every sensor on the bus at once, rather than
+ * a reset and an 8 byte MATCH_ROM each. Reads are still addressed. With
+ * parasite set the strong pull-up powers the bus until the next operation on
+ * it, which mustn't come before the conversion time is up.
+ */
+bool ds18x20_start_meas_all(bool parasite)
+{
+    if (!ow_bus_idle())
+        return true;
 
-        if (!presense)
-            continue;
+    if (parasite)
+        return ow_command_pullup(DS18X20_CONVERT_T, NULL);
 
-        if (!ow_write_byte(OW_READ_ROM))
-            continue;
+    return ow_command(DS18X20_CONVERT_T, NULL);
+}
 
-        if (!ow_read_byte(&id))
-            return false;
+/* Parasite powered sensors pull the bus low during the read slot after READ_POWER */
+bool ds18x20_parasite_powered(uint8_t *id, bool *parasite)
+{
+    bool powered;
 
-        /* Throw away the rest of the ROM ID */
-        if (!ow_bus_reset(&presense))
-            return false;
+    if (!ow_command(DS18X20_READ_POWER, id))
+        return false;
 
-        if (id == DS18B20_FAMILY_CODE || id == DS18S20_FAMILY_CODE ||
-            id == DS1822_FAMILY_CODE)
-        {
-            /* Only store the channel number, because we won't be needing full IDs in this mode! */
-            sensor_ids[*count][0] = i;
-            (*count)++;
-        }
-    }
+    if (!ow_read_bit(&powered))
+        return false;
 
+    *parasite = !powered;
     return true;
 }
 
-#endif /* _DS18X20_SINGLE_DEV_PER_CHANNEL_ */
\ No newline at end of file
+/*
+ * Sensors hold the bus low during read slots until their conversion is done.
+ * Only meaningful when they're externally powered. In parasite mode the bus
+ * is pulled up throughout, so this would report done straight away.
+ */
+bool ds18x20_conversion_done(bool *done)
+{
+    return ow_read_bit(done);
+}
+
+void ds18x20_search_start(ds18x20_search_t *search)
+{
+    search->alarm = false;
+    search->diff = OW_SEARCH_FIRST;
+}
+
+/* Finds only the sensors with their alarm flag set by the last conversion */
+void ds18x20_alarm_search_start(ds18x20_search_t *search)
+{
+    search->alarm = true;
+    search->diff = OW_SEARCH_FIRST;
+}
+
+/*
+ * One pass of a search, for running a step at a time in the background. A
+ * pass that finds a sensor leaves its ROM code in search->id. The pass after
+ * the last device reports DS18X20_SEARCH_DONE.
+ */
+int8_t ds18x20_search_next(ds18x20_search_t *search)
+{
+    if (search->diff == OW_LAST_DEVICE)
+        return DS18X20_SEARCH_DONE;
+
+    if (search->alarm)
+        search->diff = ow_alarm_search(search->diff, search->id);
+    else
+        search->diff = ow_rom_search(search->diff, search->id);
+
+    if (search->diff == OW_COMMS_ERR || search->diff == OW_DATA_ERR)
+        return DS18X20_SEARCH_ERROR;
+
+    /* Empty bus, or no alarms */
+    if (search->diff == OW_PRESENCE_ERR)
+    {
+        search->diff = OW_LAST_DEVICE;
+        return DS18X20_SEARCH_DONE;
+    }
+
+    if (search->id[0] == DS18B20_FAMILY_CODE || search->id[0] == DS18S20_FAMILY_CODE ||
+        search->id[0] == DS1822_FAMILY_CODE)
+        return DS18X20_SEARCH_FOUND;
+
+    return DS18X20_SEARCH_CONTINUE;
+}
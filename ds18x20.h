@@ -20,10 +20,31 @@
 #define __DS18X20_H__
 
 #define DS18B20_TCONV_12BIT       750
+#define DS18B20_TCONV(bits)       (DS18B20_TCONV_12BIT >> (12 - (bits)))
+
+#define DS18X20_SEARCH_ERROR      -1
+#define DS18X20_SEARCH_CONTINUE   0
+#define DS18X20_SEARCH_FOUND      1
+#define DS18X20_SEARCH_DONE       2
+
+typedef struct
+{
+    bool alarm;
+    uint8_t diff;
+    uint8_t id[DS18X20_ROMCODE_SIZE];
+} ds18x20_search_t;
 
-bool ds18x20_find_sensor(uint8_t *diff, uint8_t *id);
 bool ds18x20_start_meas(uint8_t *id);
-bool ds18x20_read_decicelsius(uint8_t *id, int16_t *decicelsius);
-bool ds18x20_search_sensors(uint8_t *count, uint8_t(*sensor_ids)[DS18X20_ROMCODE_SIZE]);
+bool ds18x20_start_meas_all(bool parasite);
+bool ds18x20_parasite_powered(uint8_t *id, bool *parasite);
+bool ds18x20_conversion_done(bool *done);
+bool ds18x20_configure(uint8_t *id, uint8_t *bits, int8_t th, int8_t tl, bool parasite);
+bool ds18x20_read_temp(uint8_t *id, int16_t *temp);
+#ifdef _DS2482_ASYNC_
+bool ds18x20_read_temp_async(uint8_t *id, void (*callback)(bool success, int16_t temp, void *data), void *data);
+#endif /* _DS2482_ASYNC_ */
+void ds18x20_search_start(ds18x20_search_t *search);
+void ds18x20_alarm_search_start(ds18x20_search_t *search);
+int8_t ds18x20_search_next(ds18x20_search_t *search);
 
 #endif /* __DS18X20_H__ */
\ No newline at end of file
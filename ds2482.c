@@ -21,11 +21,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <avr/pgmspace.h>
 
 #include "config.h"
 #include "ds2482.h"
 #include "onewire.h"
 #include "i2c.h"
+#include "timeout.h"
+#include "crc8.h"
+#include "util.h"
 
 #ifdef _OW_DS2482_
 
@@ -60,6 +64,8 @@
 #define DS2482_REG_CFG_PPM              0x02    /* presence pulse masking */
 #define DS2482_REG_CFG_APU              0x01    /* active pull-up */
 
+#define DS2482_CONFIG(cfg)              ((uint8_t)((cfg) | (~(cfg) << 4)))
+
 #define DS2482_REG_STATUS_1WB           0x01    /* busy */
 #define DS2482_REG_STATUS_PPD           0x02    /* presense pulse detect */
 #define DS2482_REG_STATUS_SD            0x04    /* short detect */
@@ -67,41 +73,233 @@
 #define DS2482_REG_STATUS_TSB           0x40    /* triple second bit */
 #define DS2482_REG_STATUS_DIR           0x80    /* direction chosen */
 
-#define DS2482_DEV_ADDR                 0x18
+#define DS2482_NO_BUS                   0xFF
+
+typedef struct
+{
+    uint8_t addr;
+    uint8_t channel;
+} ds2482_bus_t;
+
+static const ds2482_bus_t _g_buses[] PROGMEM = OW_BUSES;
+
+#define DS2482_NUM_BUSES                (sizeof(_g_buses) / sizeof(_g_buses[0]))
+
+/* main.c keeps sets of buses in uint16_t masks */
+typedef char ds2482_buses_fit_mask_t[(DS2482_NUM_BUSES <= 16) ? 1 : -1];
+
+#define DS2482_RECOVER_MIN              1       /* Seconds */
+#define DS2482_RECOVER_MAX              300
 
-#ifdef _OW_DS2482_800_
-static const uint8_t ds2482_chan_wr[8] =
+/* What the channel register reads back as, after selecting each channel */
+static const uint8_t ds2482_chan_rd[8] PROGMEM =
+    { 0xB8, 0xB1, 0xAA, 0xA3, 0x9C, 0x95, 0x8E, 0x87 };
+static const uint8_t ds2482_chan_wr[8] PROGMEM =
     { 0xF0, 0xE1, 0xD2, 0xC3, 0xB4, 0xA5, 0x96, 0x87 };
-#endif /* _OW_DS2482_800_ */
+
+static const uint8_t ds2482_ptr_data[2] = { DS2482_CMD_SET_READ_PTR, DS2482_PTR_CODE_DATA };
+
+#ifdef _DS2482_ASYNC_
+#ifndef _I2C_ASYNC_
+#error _DS2482_ASYNC_ needs _I2C_ASYNC_
+#endif /* _I2C_ASYNC_ */
+
+#define DS2482_ASYNC_IDLE               0
+#define DS2482_ASYNC_WAIT               1       /* 1-Wire op running */
+#define DS2482_ASYNC_FETCH              2       /* Reading a byte's result */
+
+#define DS2482_ASYNC_TIMEOUT            10      /* Ticks */
+
+typedef struct
+{
+    uint8_t state;
+    uint8_t count;
+    uint8_t step;
+    uint8_t reads;
+    int32_t issued;
+    uint8_t ops[DS2482_ASYNC_MAX_OPS];
+    uint8_t data[DS2482_ASYNC_MAX_OPS];
+    void (*callback)(bool success, void *data);
+    void *cb_data;
+    uint8_t cmd[2];
+    uint8_t status;
+    i2c_xfer_t xfer;
+} ds2482_async_t;
+
+static ds2482_async_t _g_async;
+#endif /* _DS2482_ASYNC_ */
 
 static uint8_t _g_devAddr;
+static uint8_t _g_bus;
 
-static bool ds2482_reset(void);
+static uint16_t _g_errors[DS2482_NUM_BUSES][DS2482_NUM_ERRS];
+static uint8_t _g_err_bus;              /* What errors are counted against */
+static bool _g_fault;                   /* I2C or busy timeout since the last select */
+static uint16_t _g_recover_delay;
+static int32_t _g_recover_last;
 
+static bool ds2482_reset(void);
+static bool ds2482_i2c_failed(void);
+static bool ds2482_1wire(uint8_t cmd, uint8_t param, uint8_t len, uint8_t *status);
+static bool ds2482_address(uint8_t *id);
+static uint8_t ds2482_search(uint8_t command, uint8_t diff, uint8_t *id);
+#ifdef _DS2482_ASYNC_
+static bool ds2482_async_issue(ds2482_async_t *as);
+static bool ds2482_async_xfer(ds2482_async_t *as, const uint8_t *wr, uint8_t wr_len, uint8_t *rd);
+static void ds2482_async_xfer_done(bool success, void *data);
+static void ds2482_async_finish(ds2482_async_t *as, bool success);
+#endif /* _DS2482_ASYNC_ */
+
+/* Resets and configures every master in the bus table. Each only once. */
 bool ds2482_init(void)
 {
-    uint8_t cfg = DS2482_REG_CFG_APU;
+    uint8_t i;
+    uint8_t j;
+    bool ret = true;
 
-    _g_devAddr = DS2482_DEV_ADDR;
+    _g_bus = DS2482_NO_BUS;
 
-    if (!ds2482_reset())
-        return false;
+    for (i = 0; i < DS2482_NUM_BUSES; i++)
+    {
+        _g_devAddr = pgm_read_byte(&_g_buses[i].addr);
+
+        for (j = 0; j < i; j++)
+        {
+            if (pgm_read_byte(&_g_buses[j].addr) == _g_devAddr)
+                break;
+        }
 
-    if (!i2c_write(_g_devAddr, DS2482_CMD_WRITE_CONFIG, (cfg) | (~cfg) << 4))
+        if (j < i)
+            continue;
+
+        _g_err_bus = i;
+
+        if (!ds2482_reset() ||
+            !i2c_write(_g_devAddr, DS2482_CMD_WRITE_CONFIG, DS2482_CONFIG(DS2482_REG_CFG_APU)))
+        {
+            printf("DS2482 at 0x%02X not responding\r\n", _g_devAddr);
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+uint8_t ds2482_num_buses(void)
+{
+    return DS2482_NUM_BUSES;
+}
+
+/* Buses on the same DS2482 return the same number: the first of them in the table */
+uint8_t ds2482_bus_master(uint8_t bus)
+{
+    uint8_t addr = pgm_read_byte(&_g_buses[bus].addr);
+    uint8_t i;
+
+    for (i = 0; pgm_read_byte(&_g_buses[i].addr) != addr; i++)
+        ;
+
+    return i;
+}
+
+/* Points the 1-Wire functions at a bus. Cheap when it's already selected. */
+bool ds2482_select_bus(uint8_t bus)
+{
+    uint8_t channel;
+    uint8_t check;
+
+    _g_fault = false;
+
+    if (bus == _g_bus)
+        return true;
+
+    if (bus >= DS2482_NUM_BUSES)
         return false;
 
+    _g_err_bus = bus;
+    _g_bus = DS2482_NO_BUS;
+    _g_devAddr = pgm_read_byte(&_g_buses[bus].addr);
+    channel = pgm_read_byte(&_g_buses[bus].channel);
+
+    if (channel != DS2482_100)
+    {
+        uint8_t cmd[2] = { DS2482_CMD_CHANNEL_SELECT, pgm_read_byte(&ds2482_chan_wr[channel]) };
+
+        /* Read pointer is left on the channel register */
+        if (!i2c_write_read(_g_devAddr, cmd, 2, &check))
+            return ds2482_i2c_failed();
+
+        if (check != pgm_read_byte(&ds2482_chan_rd[channel]))
+        {
+            _g_fault = true;
+            return false;
+        }
+    }
+
+    _g_bus = bus;
     return true;
 }
 
+/* Counts an error against the selected bus */
+void ds2482_record_error(uint8_t err)
+{
+    if (_g_errors[_g_err_bus][err] != 0xFFFF)
+        _g_errors[_g_err_bus][err]++;
+}
+
+uint16_t ds2482_error_count(uint8_t bus, uint8_t err)
+{
+    return _g_errors[bus][err];
+}
+
+/* An I2C failure or busy timeout since the bus was last selected */
+bool ds2482_bus_fault(void)
+{
+    return _g_fault;
+}
+
+static bool ds2482_i2c_failed(void)
+{
+    ds2482_record_error(i2c_error());
+    _g_fault = true;
+    return false;
+}
+
+/*
+ * Clocks out whatever has hold of the I2C bus and resets every master. After
+ * a failed attempt the next one waits 1, 2, 4... seconds, so a dead master
+ * isn't reset again on every read.
+ */
+bool ds2482_recover(void)
+{
+    if (_g_recover_delay &&
+        (get_tick_count() - _g_recover_last) < ((int32_t)_g_recover_delay * TIMEOUT_TICK_PER_SECOND))
+        return false;
+
+    _g_recover_last = get_tick_count();
+
+#ifdef _I2C_BRUTEFORCE_RESET_
+    i2c_bruteforce_reset();
+#endif /* _I2C_BRUTEFORCE_RESET_ */
+
+    if (ds2482_init())
+    {
+        _g_recover_delay = 0;
+        return true;
+    }
+
+    _g_recover_delay = _g_recover_delay ? min_(_g_recover_delay * 2, DS2482_RECOVER_MAX) : DS2482_RECOVER_MIN;
+    return false;
+}
+
 static bool ds2482_reset(void)
 {
+    uint8_t cmd = DS2482_CMD_RESET;
     uint8_t status;
 
-    if (!i2c_write_byte(_g_devAddr, DS2482_CMD_RESET))
-        return false;
-    
-    if (!i2c_read_byte(_g_devAddr, &status))
-        return false;
+    /* Read pointer is left on the status register */
+    if (!i2c_write_read(_g_devAddr, &cmd, 1, &status))
+        return ds2482_i2c_failed();
 
     if ((status & 0xF7) != 0x10)
         return false;
@@ -109,21 +307,32 @@ static bool ds2482_reset(void)
     return true;
 }
 
+/* Runs a 1-Wire command (len 2 when it takes a parameter) and waits for it to finish */
+static bool ds2482_1wire(uint8_t cmd, uint8_t param, uint8_t len, uint8_t *status)
+{
+    uint8_t data[2] = { cmd, param };
+
+    if (!i2c_write_await_flag(_g_devAddr, data, len, DS2482_REG_STATUS_1WB, status, DS2482_WAIT_CYCLES))
+        return ds2482_i2c_failed();
+
+    return true;
+}
+
 bool ds2482_bus_reset(bool *presense_detect)
 {
     uint8_t status;
 
     *presense_detect = true;
 
-    if (!i2c_write_byte(_g_devAddr, DS2482_CMD_1WIRE_RESET))
-        return false;
-
-    if (!i2c_await_flag(_g_devAddr, DS2482_REG_STATUS_1WB, &status, DS2482_WAIT_CYCLES))
+    if (!ds2482_1wire(DS2482_CMD_1WIRE_RESET, 0, 1, &status))
         return false;
 
     /* Check for short condition */
     if (status & DS2482_REG_STATUS_SD)
+    {
+        ds2482_record_error(DS2482_ERR_SHORT);
         return false;
+    }
 
     /* Check for presence detect */
     if (!(status & DS2482_REG_STATUS_PPD))
@@ -133,6 +342,38 @@ bool ds2482_bus_reset(bool *presense_detect)
 }
 
 bool ds2482_command(uint8_t command, uint8_t *id)
+{
+    if (!ds2482_address(id))
+        return false;
+
+    if (!ds2482_write_byte(command))
+        return false;
+
+    return true;
+}
+
+/*
+ * As ds2482_command(), with the strong pull-up switched on once the command
+ * byte is sent, to power parasite devices through a conversion or EEPROM copy.
+ * It stays on until the next 1-Wire operation on this DS2482, which also
+ * includes selecting another of its channels.
+ */
+bool ds2482_command_pullup(uint8_t command, uint8_t *id)
+{
+    if (!ds2482_address(id))
+        return false;
+
+    if (!i2c_write(_g_devAddr, DS2482_CMD_WRITE_CONFIG, DS2482_CONFIG(DS2482_REG_CFG_APU | DS2482_REG_CFG_SPU)))
+        return ds2482_i2c_failed();
+
+    if (!ds2482_write_byte(command))
+        return false;
+
+    return true;
+}
+
+/* Reset, then MATCH_ROM to one device or SKIP_ROM to all of them */
+static bool ds2482_address(uint8_t *id)
 {
     uint8_t i;
     bool presense;
@@ -160,28 +401,18 @@ bool ds2482_command(uint8_t command, uint8_t *id)
             return false;
     }
 
-    if (!ds2482_write_byte(command))
-        return false;
-
     return true;
 }
 
 bool ds2482_read_byte(uint8_t *ret)
 {
+    uint8_t cmd = DS2482_CMD_1WIRE_READ_BYTE;
     uint8_t data;
-    uint8_t status;
-
-    if (!i2c_write_byte(_g_devAddr, DS2482_CMD_1WIRE_READ_BYTE))
-        return false;
 
-    if (!i2c_await_flag(_g_devAddr, DS2482_REG_STATUS_1WB, &status, DS2482_WAIT_CYCLES))
-        return false;
-
-    if (!i2c_write(_g_devAddr, DS2482_CMD_SET_READ_PTR, DS2482_PTR_CODE_DATA))
-        return false;
-
-    if (!i2c_read_byte(_g_devAddr, &data))
-        return false;
+    /* Command, busy poll, read pointer change and data read in one transaction */
+    if (!i2c_write_await_read(_g_devAddr, &cmd, 1, DS2482_REG_STATUS_1WB,
+            ds2482_ptr_data, &data, DS2482_WAIT_CYCLES))
+        return ds2482_i2c_failed();
 
     *ret = data;
     return true;
@@ -191,28 +422,46 @@ bool ds2482_write_byte(uint8_t data)
 {
     uint8_t status;
 
-    if (!i2c_write(_g_devAddr, DS2482_CMD_1WIRE_WRITE_BYTE, data))
-        return false;
+    return ds2482_1wire(DS2482_CMD_1WIRE_WRITE_BYTE, data, 2, &status);
+}
 
-    if (!i2c_await_flag(_g_devAddr, DS2482_REG_STATUS_1WB, &status, DS2482_WAIT_CYCLES))
+/* Issues a single read time slot */
+bool ds2482_read_bit(bool *bit)
+{
+    uint8_t status;
+
+    if (!ds2482_1wire(DS2482_CMD_1WIRE_SINGLE_BIT, 0x80, 2, &status))
         return false;
 
+    *bit = (status & DS2482_REG_STATUS_SBR) ? true : false;
     return true;
 }
 
 uint8_t ds2482_rom_search(uint8_t diff, uint8_t *id)
+{
+    return ds2482_search(OW_SEARCH_ROM, diff, id);
+}
+
+/* Same as a ROM search, but only sensors whose last reading was outside TH/TL take part */
+uint8_t ds2482_alarm_search(uint8_t diff, uint8_t *id)
+{
+    return ds2482_search(OW_ALARM_SEARCH, diff, id);
+}
+
+static uint8_t ds2482_search(uint8_t command, uint8_t diff, uint8_t *id)
 {
     uint8_t status;
     uint8_t i;
     uint8_t j;
     uint8_t next_diff;
+    uint8_t *rom = id;
     bool presense;
 
     if (!ds2482_bus_reset(&presense))
         return OW_COMMS_ERR;
     if (!presense)
         return OW_PRESENCE_ERR;            /* No device found. early exit. */
-    if (!ds2482_write_byte(OW_SEARCH_ROM)) /* ROM search command */
+    if (!ds2482_write_byte(command))       /* ROM or alarm search command */
         return OW_COMMS_ERR;
 
     next_diff = OW_LAST_DEVICE;            /* Unchanged on last device */
@@ -229,14 +478,15 @@ uint8_t ds2482_rom_search(uint8_t diff, uint8_t *id)
             if (diff > i || ((*id & 1) && diff != i)) /* Use '1' on this pass */
                 search_direction = DS2482_CMD_1WIRE_TRIPLET_DIR;
 
-            if (!i2c_write(_g_devAddr, DS2482_CMD_1WIRE_TRIPLET, search_direction))
-                return OW_COMMS_ERR;
-
-            if (!i2c_await_flag(_g_devAddr, DS2482_REG_STATUS_1WB, &status, DS2482_WAIT_CYCLES))
+            if (!ds2482_1wire(DS2482_CMD_1WIRE_TRIPLET, search_direction, 2, &status))
                 return OW_COMMS_ERR;
 
             if ((status & DS2482_REG_STATUS_SBR) && (status & DS2482_REG_STATUS_TSB))
+            {
+                if (i == DS18X20_ROMCODE_SIZE * 8)
+                    return OW_PRESENCE_ERR; /* Nobody answered. No alarms. */
                 return OW_DATA_ERR;        /* Data error. Early exit. */
+            }
 
             if (!(status & DS2482_REG_STATUS_SBR) && !(status & DS2482_REG_STATUS_TSB))
             {
@@ -255,22 +505,195 @@ uint8_t ds2482_rom_search(uint8_t diff, uint8_t *id)
         id++;                              /* Next byte */
     } while (i);
 
+    if (crc8(rom, DS18X20_ROMCODE_SIZE))
+        return OW_DATA_ERR;                /* Corrupted ROM code */
+
     return next_diff;                      /* To continue search */
 }
 
-#ifdef _OW_DS2482_800_
+#ifdef _DS2482_ASYNC_
 
-bool ds2482_select_channel(uint8_t channel)
+/*
+ * Step-wise 1-Wire transactions. A sequence of resets, byte writes and byte
+ * reads is queued up and then run as queued I2C transfers, each step started
+ * from the completion of the last, so nothing here waits on the bus or the
+ * 1-Wire busy flag and the loop keeps servicing the modem meanwhile. Each
+ * 1-Wire command and its first status read are one transfer. The callback is
+ * run once the sequence completes or fails. Bytes read are packed in order at
+ * the front of the data buffer.
+ *
+ * The blocking functions above mustn't be used while a sequence is running.
+ */
+bool ds2482_async_begin(void)
 {
-    if (channel >= 8)
+    ds2482_async_t *as = &_g_async;
+
+    if (as->state != DS2482_ASYNC_IDLE)
         return false;
-    
-    if (!i2c_write(_g_devAddr, DS2482_CMD_CHANNEL_SELECT, ds2482_chan_wr[channel]))
+
+    as->count = 0;
+    return true;
+}
+
+bool ds2482_async_add(uint8_t op, uint8_t data)
+{
+    ds2482_async_t *as = &_g_async;
+
+    if (as->count == DS2482_ASYNC_MAX_OPS)
         return false;
-    
+
+    as->ops[as->count] = op;
+    as->data[as->count] = data;
+    as->count++;
+
     return true;
 }
 
-#endif /* _OW_DS2482_800_ */
+bool ds2482_async_run(void (*callback)(bool success, void *data), void *data)
+{
+    ds2482_async_t *as = &_g_async;
+
+    if (as->state != DS2482_ASYNC_IDLE || !as->count)
+        return false;
+
+    as->step = 0;
+    as->reads = 0;
+    as->callback = callback;
+    as->cb_data = data;
+
+    return ds2482_async_issue(as);
+}
+
+bool ds2482_async_busy(void)
+{
+    return _g_async.state != DS2482_ASYNC_IDLE;
+}
+
+uint8_t *ds2482_async_data(void)
+{
+    return _g_async.data;
+}
+
+static bool ds2482_async_issue(ds2482_async_t *as)
+{
+    uint8_t len = 1;
+
+    switch (as->ops[as->step])
+    {
+        case DS2482_OP_RESET:
+            as->cmd[0] = DS2482_CMD_1WIRE_RESET;
+            break;
+        case DS2482_OP_WRITE:
+            as->cmd[0] = DS2482_CMD_1WIRE_WRITE_BYTE;
+            as->cmd[1] = as->data[as->step];
+            len = 2;
+            break;
+        case DS2482_OP_READ:
+            as->cmd[0] = DS2482_CMD_1WIRE_READ_BYTE;
+            break;
+    }
+
+    as->issued = get_tick_count();
+    as->state = DS2482_ASYNC_WAIT;
+
+    /* Read pointer is left on the status register after a 1-Wire command */
+    if (ds2482_async_xfer(as, as->cmd, len, &as->status))
+        return true;
+
+    as->state = DS2482_ASYNC_IDLE;
+    return false;
+}
+
+static bool ds2482_async_xfer(ds2482_async_t *as, const uint8_t *wr, uint8_t wr_len, uint8_t *rd)
+{
+    i2c_xfer_t *xfer = &as->xfer;
+
+    xfer->addr = _g_devAddr;
+    xfer->wr = wr;
+    xfer->wr_len = wr_len;
+    xfer->rd = rd;
+    xfer->rd_len = 1;
+    xfer->callback = &ds2482_async_xfer_done;
+    xfer->data = as;
+
+    return i2c_queue(xfer);
+}
+
+/* Run by i2c_process() as each transfer finishes */
+static void ds2482_async_xfer_done(bool success, void *data)
+{
+    ds2482_async_t *as = (ds2482_async_t *)data;
+
+    if (!success)
+    {
+        ds2482_i2c_failed();
+        goto fail;
+    }
+
+    if (as->state == DS2482_ASYNC_FETCH)
+    {
+        as->reads++;
+        goto next;
+    }
+
+    if (as->status & DS2482_REG_STATUS_1WB)
+    {
+        if ((get_tick_count() - as->issued) > DS2482_ASYNC_TIMEOUT)
+        {
+            ds2482_record_error(DS2482_ERR_1WB);
+            _g_fault = true;
+            goto fail;
+        }
+
+        if (!ds2482_async_xfer(as, NULL, 0, &as->status))
+            goto fail;
+        return;
+    }
+
+    switch (as->ops[as->step])
+    {
+        case DS2482_OP_RESET:
+            if (as->status & DS2482_REG_STATUS_SD)
+            {
+                ds2482_record_error(DS2482_ERR_SHORT);
+                goto fail;
+            }
+            if (!(as->status & DS2482_REG_STATUS_PPD))
+                goto fail;
+            break;
+        case DS2482_OP_READ:
+            as->state = DS2482_ASYNC_FETCH;
+            /* Never ahead of step, so this only overwrites bytes already sent */
+            if (!ds2482_async_xfer(as, ds2482_ptr_data, 2, &as->data[as->reads]))
+                goto fail;
+            return;
+    }
+
+next:
+    if (++as->step == as->count)
+    {
+        ds2482_async_finish(as, true);
+        return;
+    }
+
+    if (!ds2482_async_issue(as))
+        goto fail;
+
+    return;
+
+fail:
+    ds2482_async_finish(as, false);
+}
+
+static void ds2482_async_finish(ds2482_async_t *as, bool success)
+{
+    /* Idle first, so the callback can start another sequence */
+    as->state = DS2482_ASYNC_IDLE;
+
+    if (as->callback)
+        as->callback(success, as->cb_data);
+}
+
+#endif /* _DS2482_ASYNC_ */
 
 #endif /* _OW_DS2482_ */
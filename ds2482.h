@@ -19,14 +19,47 @@
 #ifndef __DS2482_H__
 #define	__DS2482_H__
 
+#define DS2482_100              0xFF /* Channel of a bus on a DS2482-100 */
+
+#define DS2482_ERR_NACK         0    /* The first four match I2C_ERR_xxx */
+#define DS2482_ERR_ARB_LOST     1
+#define DS2482_ERR_TIMEOUT      2
+#define DS2482_ERR_1WB          3    /* 1-Wire busy never cleared */
+#define DS2482_ERR_SHORT        4
+#define DS2482_ERR_CRC          5
+#define DS2482_NUM_ERRS         6
+
 bool ds2482_init(void);
+uint8_t ds2482_num_buses(void);
+uint8_t ds2482_bus_master(uint8_t bus);
+bool ds2482_select_bus(uint8_t bus);
+void ds2482_record_error(uint8_t err);
+uint16_t ds2482_error_count(uint8_t bus, uint8_t err);
+bool ds2482_bus_fault(void);
+bool ds2482_recover(void);
 bool ds2482_bus_reset(bool *presense_detect);
 bool ds2482_command(uint8_t command, uint8_t *id);
+bool ds2482_command_pullup(uint8_t command, uint8_t *id);
 bool ds2482_read_byte(uint8_t *ret);
 bool ds2482_write_byte(uint8_t data);
-#ifdef _OW_DS2482_800_
-bool ds2482_select_channel(uint8_t channel);
-#endif /* _OW_DS2482_800_ */
+bool ds2482_read_bit(bool *bit);
 uint8_t ds2482_rom_search(uint8_t diff, uint8_t *id);
+uint8_t ds2482_alarm_search(uint8_t diff, uint8_t *id);
+
+#ifdef _DS2482_ASYNC_
+
+#define DS2482_OP_RESET         0
+#define DS2482_OP_WRITE         1
+#define DS2482_OP_READ          2
+
+#define DS2482_ASYNC_MAX_OPS    20 /* Reset, MATCH_ROM, ROM code, command and a scratchpad */
+
+bool ds2482_async_begin(void);
+bool ds2482_async_add(uint8_t op, uint8_t data);
+bool ds2482_async_run(void (*callback)(bool success, void *data), void *data);
+bool ds2482_async_busy(void);
+uint8_t *ds2482_async_data(void);
+
+#endif /* _DS2482_ASYNC_ */
 
 #endif /* __DS2482_H__ */
\ No newline at end of file
@@ -0,0 +1,357 @@
+/*
+ *   File:   gprs.c
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 16:40
+ *
+ *   Batched telemetry upload over GPRS. Telemetry records are sampled into a
+ *   ring buffer and POSTed to a configured URL in one go, one "T:" line per
+ *   record (the same format as the telemetry SMS), so the cost of bringing up
+ *   the bearer is spread over many samples. SMS stays for alerts.
+ *
+ *   Records stay in the ring until the server has returned 2xx for them.
+ *   Failed uploads are retried with an exponential backoff. When the ring
+ *   fills up the oldest records are dropped, unless they're being uploaded,
+ *   in which case the new one is.
+ *
+ *   Each step is a single modem operation, started only when the modem is
+ *   idle, so SMS traffic interleaves with an upload between steps.
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "project.h"
+
+#ifdef _GSM_GPRS_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "timeout.h"
+#include "util.h"
+#include "gsm.h"
+#include "gprs.h"
+
+#define GPRS_STATE_IDLE                  0
+#define GPRS_STATE_CONTYPE               1
+#define GPRS_STATE_APN                   2
+#define GPRS_STATE_BEARER_OPEN           3
+#define GPRS_STATE_HTTP_INIT             4
+#define GPRS_STATE_HTTP_CID              5
+#define GPRS_STATE_HTTP_URL              6
+#define GPRS_STATE_HTTP_CONTENT          7
+#define GPRS_STATE_HTTP_DATA             8
+#define GPRS_STATE_HTTP_ACTION           9
+#define GPRS_STATE_HTTP_TERM             10
+#define GPRS_STATE_BEARER_CLOSE          11
+
+#define GPRS_RETRY_MIN                   60    /* Seconds */
+#define GPRS_RETRY_MAX                   3600  /* Seconds */
+
+typedef struct
+{
+    uint8_t state;
+    bool busy;
+    bool failed;
+    sys_config_t *config;
+    uint16_t head;
+    uint16_t tail;
+    uint16_t used;
+    uint16_t upload_bytes;
+    int32_t last_sample;
+    int32_t next_upload;
+    uint16_t retry_delay;
+} gprs_state_t;
+
+gprs_state_t _g_gprs_state;
+uint8_t _g_gprs_ring[GPRS_RING_SIZE];
+
+static void gprs_start_step(gprs_state_t *st);
+static void gprs_step_success(void *data);
+static void gprs_step_fail(void *data);
+static void gprs_upload_finished(gprs_state_t *st);
+static void gprs_sample(gprs_state_t *st);
+static void gprs_drop_oldest(gprs_state_t *st);
+static uint8_t gprs_ring_read(gprs_state_t *st, uint16_t pos, uint8_t *data);
+static uint16_t gprs_body_length(gprs_state_t *st);
+static void gprs_write_body(void);
+
+extern uint8_t telemetry_record(uint8_t *data, uint8_t max);
+
+void gprs_init(sys_config_t *config)
+{
+    gprs_state_t *st = &_g_gprs_state;
+
+    st->state = GPRS_STATE_IDLE;
+    st->busy = false;
+    st->config = config;
+    st->head = 0;
+    st->tail = 0;
+    st->used = 0;
+    st->last_sample = get_tick_count();
+    st->next_upload = get_tick_count() + ((int32_t)config->gprs_upload * 60 * TIMEOUT_TICK_PER_SECOND);
+    st->retry_delay = GPRS_RETRY_MIN;
+}
+
+void gprs_process(void)
+{
+    gprs_state_t *st = &_g_gprs_state;
+
+    if (!*st->config->gprs_url)
+        return;
+
+    if (st->config->gprs_sample &&
+        (get_tick_count() - st->last_sample) >= ((int32_t)st->config->gprs_sample * TIMEOUT_TICK_PER_SECOND))
+    {
+        st->last_sample = get_tick_count();
+        gprs_sample(st);
+    }
+
+    if (st->busy || !gsm_ready())
+        return;
+
+    if (st->state == GPRS_STATE_IDLE)
+    {
+        if (!st->config->gprs_upload || !st->used)
+            return;
+
+        if ((int32_t)(get_tick_count() - st->next_upload) < 0)
+            return;
+
+        // Everything in the ring now goes in this batch. Anything sampled
+        // from here on waits for the next one.
+        st->upload_bytes = st->used;
+        st->failed = false;
+        st->state = GPRS_STATE_CONTYPE;
+
+        printf("GPRS: Starting upload of %u bytes\r\n", st->upload_bytes);
+    }
+
+    gprs_start_step(st);
+}
+
+static void gprs_start_step(gprs_state_t *st)
+{
+    char send_buf[MAX_URL + 24];
+    gsm_cb_t cb;
+
+    cb.success_callback = &gprs_step_success;
+    cb.fail_callback = &gprs_step_fail;
+    cb.data = st;
+
+    st->busy = true;
+
+    switch (st->state)
+    {
+        case GPRS_STATE_CONTYPE:
+            sprintf(send_buf, "AT+SAPBR=3,1,\"Contype\",\"GPRS\"\r");
+            break;
+        case GPRS_STATE_APN:
+            sprintf(send_buf, "AT+SAPBR=3,1,\"APN\",\"%s\"\r", st->config->gprs_apn);
+            break;
+        case GPRS_STATE_BEARER_OPEN:
+            sprintf(send_buf, "AT+SAPBR=1,1\r");
+            break;
+        case GPRS_STATE_HTTP_INIT:
+            sprintf(send_buf, "AT+HTTPINIT\r");
+            break;
+        case GPRS_STATE_HTTP_CID:
+            sprintf(send_buf, "AT+HTTPPARA=\"CID\",1\r");
+            break;
+        case GPRS_STATE_HTTP_URL:
+            sprintf(send_buf, "AT+HTTPPARA=\"URL\",\"%s\"\r", st->config->gprs_url);
+            break;
+        case GPRS_STATE_HTTP_CONTENT:
+            sprintf(send_buf, "AT+HTTPPARA=\"CONTENT\",\"text/plain\"\r");
+            break;
+        case GPRS_STATE_HTTP_DATA:
+            gsm_http_data(gprs_body_length(st), &gprs_write_body, &cb);
+            return;
+        case GPRS_STATE_HTTP_ACTION:
+            gsm_http_action(&cb);
+            return;
+        case GPRS_STATE_HTTP_TERM:
+            sprintf(send_buf, "AT+HTTPTERM\r");
+            break;
+        case GPRS_STATE_BEARER_CLOSE:
+            sprintf(send_buf, "AT+SAPBR=0,1\r");
+            break;
+    }
+
+    gsm_command(send_buf, &cb);
+}
+
+static void gprs_step_success(void *data)
+{
+    gprs_state_t *st = (gprs_state_t *)data;
+
+    st->busy = false;
+
+    if (st->state == GPRS_STATE_BEARER_CLOSE)
+        gprs_upload_finished(st);
+    else
+        st->state++;
+}
+
+static void gprs_step_fail(void *data)
+{
+    gprs_state_t *st = (gprs_state_t *)data;
+
+    st->busy = false;
+
+    // Bearer is probably already up from a session that didn't get torn down
+    if (st->state == GPRS_STATE_BEARER_OPEN)
+    {
+        st->state++;
+        return;
+    }
+
+    // Tear down is best effort
+    if (st->state == GPRS_STATE_BEARER_CLOSE)
+    {
+        gprs_upload_finished(st);
+        return;
+    }
+
+    if (st->state == GPRS_STATE_HTTP_TERM)
+    {
+        st->state++;
+        return;
+    }
+
+    printf("GPRS: ERROR: Upload failed at step %u\r\n", st->state);
+    st->failed = true;
+    st->state = (st->state > GPRS_STATE_BEARER_OPEN) ? GPRS_STATE_HTTP_TERM : GPRS_STATE_BEARER_CLOSE;
+}
+
+static void gprs_upload_finished(gprs_state_t *st)
+{
+    uint16_t delay;
+
+    st->state = GPRS_STATE_IDLE;
+
+    if (st->failed)
+    {
+        printf("GPRS: Retrying in %u seconds\r\n", st->retry_delay);
+
+        delay = st->retry_delay;
+        st->retry_delay = min_(st->retry_delay * 2, GPRS_RETRY_MAX);
+        st->next_upload = get_tick_count() + ((int32_t)delay * TIMEOUT_TICK_PER_SECOND);
+        return;
+    }
+
+    printf("GPRS: Upload complete\r\n");
+
+    // Drop what was sent. Newer samples stay for the next batch.
+    st->tail = (st->tail + st->upload_bytes) % GPRS_RING_SIZE;
+    st->used -= st->upload_bytes;
+
+    st->retry_delay = GPRS_RETRY_MIN;
+    st->next_upload = get_tick_count() + ((int32_t)st->config->gprs_upload * 60 * TIMEOUT_TICK_PER_SECOND);
+}
+
+/* Records are stored with a length byte in front */
+static void gprs_sample(gprs_state_t *st)
+{
+    uint8_t data[MAX_TELEMETRY];
+    uint8_t len;
+    uint8_t i;
+
+    len = telemetry_record(data, MAX_TELEMETRY);
+
+    // The oldest records are the ones being uploaded. Can't touch those.
+    if ((GPRS_RING_SIZE - st->used) < (len + 1) && st->state != GPRS_STATE_IDLE)
+    {
+        printf("GPRS: Buffer full during upload. Dropping sample\r\n");
+        return;
+    }
+
+    while ((GPRS_RING_SIZE - st->used) < (len + 1))
+        gprs_drop_oldest(st);
+
+    _g_gprs_ring[st->head] = len;
+    st->head = (st->head + 1) % GPRS_RING_SIZE;
+
+    for (i = 0; i < len; i++)
+    {
+        _g_gprs_ring[st->head] = data[i];
+        st->head = (st->head + 1) % GPRS_RING_SIZE;
+    }
+
+    st->used += len + 1;
+}
+
+/* Makes room when the network has been down for a while */
+static void gprs_drop_oldest(gprs_state_t *st)
+{
+    uint8_t len = _g_gprs_ring[st->tail] + 1;
+
+    st->tail = (st->tail + len) % GPRS_RING_SIZE;
+    st->used -= len;
+
+    printf("GPRS: Buffer full. Dropped oldest sample\r\n");
+}
+
+static uint8_t gprs_ring_read(gprs_state_t *st, uint16_t pos, uint8_t *data)
+{
+    uint8_t len = _g_gprs_ring[pos];
+    uint8_t i;
+
+    for (i = 0; i < len; i++)
+        data[i] = _g_gprs_ring[(pos + 1 + i) % GPRS_RING_SIZE];
+
+    return len;
+}
+
+/* "T:" + base64 + "\n" for each record in the batch */
+static uint16_t gprs_body_length(gprs_state_t *st)
+{
+    uint16_t length = 0;
+    uint16_t offset = 0;
+
+    while (offset < st->upload_bytes)
+    {
+        uint8_t len = _g_gprs_ring[(st->tail + offset) % GPRS_RING_SIZE];
+
+        length += 3 + (((len + 2) / 3) * 4);
+        offset += len + 1;
+    }
+
+    return length;
+}
+
+static void gprs_write_body(void)
+{
+    gprs_state_t *st = &_g_gprs_state;
+    uint8_t data[MAX_TELEMETRY];
+    char line[((MAX_TELEMETRY + 2) / 3) * 4 + 4];
+    uint16_t offset = 0;
+
+    while (offset < st->upload_bytes)
+    {
+        uint16_t pos = (st->tail + offset) % GPRS_RING_SIZE;
+        uint8_t len = gprs_ring_read(st, pos, data);
+
+        strcpy_P(line, PSTR("T:"));
+        base64_encode(line + 2, data, len);
+        strcat_P(line, PSTR("\n"));
+        gsm_write(line);
+
+        offset += len + 1;
+    }
+}
+
+#endif /* _GSM_GPRS_ */
@@ -0,0 +1,25 @@
+/*
+ *   File:   gprs.h
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 16:40
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GPRS_H__
+#define __GPRS_H__
+
+void gprs_init(sys_config_t *config);
+void gprs_process(void);
+
+#endif /* __GPRS_H__ */
@@ -27,6 +27,7 @@
 #include <util/delay.h>
 
 #include "gsm.h"
+#include "pdu.h"
 #include "timeout.h"
 #include "usart.h"
 #include "util.h"
@@ -42,6 +43,8 @@
 #define GSM_STATE_AWAIT_READ_ALL_SMS_META     8
 #define GSM_STATE_AWAIT_READ_ALL_SMS_TEXT     9
 #define GSM_STATE_AWAIT_RESPONSE              10
+#define GSM_STATE_AWAIT_HTTP_DOWNLOAD         11
+#define GSM_STATE_AWAIT_HTTP_ACTION           12
 
 #define MAX_RX_BUFFER                         128
 #define MAX_SMS_BUFFER                        (MAX_SMS * 2)
@@ -53,7 +56,7 @@
 
 static uint8_t _g_gsm_state;
 static uint8_t _g_init_flags;
-static uint8_t _g_rx_index;
+static uint16_t _g_rx_index;
 static int8_t _g_abort_timer;
 static int16_t _g_last_index;
 
@@ -68,6 +71,10 @@ union
 
 void (*_g_ready_callback)(void);
 
+#ifdef _GSM_GPRS_
+static void (*_g_http_writer)(void);
+#endif /* _GSM_GPRS_ */
+
 static void gsm_update_state(uint8_t newstate);
 static void gsm_fill_line_buffer(const char c);
 static void gsm_fill_message_buffer(const char c);
@@ -158,12 +165,25 @@ static void gsm_fill_message_buffer(const char c)
 
     else if (c != '\n')
     {
+#ifdef _GSM_PDU_MODE_
+        // Pack the hex straight to binary. The index counts nibbles.
+        if (_g_rx_index < (MAX_SMS_BUFFER * 2))
+        {
+            if (_g_rx_index & 1)
+                _g_message_buffer[_g_rx_index / 2] |= pdu_hex_nibble(c);
+            else
+                _g_message_buffer[_g_rx_index / 2] = pdu_hex_nibble(c) << 4;
+
+            _g_rx_index++;
+        }
+#else
         if (_g_rx_index < MAX_SMS_BUFFER)
         {
             _g_message_buffer[_g_rx_index] = c;
             _g_rx_index++;
             _g_message_buffer[_g_rx_index] = 0;
         }
+#endif /* _GSM_PDU_MODE_ */
     }
     else
     {
@@ -264,7 +284,11 @@ static void gsm_process_line(uint8_t state, const char *line)
         {
             char send_buf[64];
             // Now set message format.
+#ifdef _GSM_PDU_MODE_
+            sprintf(send_buf, "AT+CMGF=0\r");
+#else
             sprintf(send_buf, "AT+CMGF=1\r");
+#endif /* _GSM_PDU_MODE_ */
             gsm_puts(send_buf);
             gsm_update_state(GSM_STATE_AWAIT_CMGF);
         }
@@ -291,7 +315,7 @@ static void gsm_process_line(uint8_t state, const char *line)
     else if (state == GSM_STATE_AWAIT_SEND_SMS_RESPONSE)
     {
         //printf("got: %s\r\n", line);
-        if (!strncmp_p(line, "+CMGS:", 6))
+        if (!strncmp_p(line, "+CMGS", 5)) /* +CMGS: or +CMGSEX: */
             goto done;
 
         if (!strcmp_p(line, "OK"))
@@ -343,6 +367,51 @@ static void gsm_process_line(uint8_t state, const char *line)
         else
             gsm_finish_operation(false);
     }
+#ifdef _GSM_GPRS_
+    else if (state == GSM_STATE_AWAIT_HTTP_DOWNLOAD)
+    {
+        if (!strcmp_p(line, "DOWNLOAD"))
+        {
+            // Modem is ready for the body. It replies OK once it has all of it.
+            gsm_update_state(GSM_STATE_AWAIT_RESPONSE);
+            _g_http_writer();
+        }
+        else
+        {
+            gsm_finish_operation(false);
+        }
+    }
+    else if (state == GSM_STATE_AWAIT_HTTP_ACTION)
+    {
+        // OK only means the request has started. The result comes later.
+        if (!strcmp_p(line, "OK"))
+            goto done;
+
+        if (!strncmp_p(line, "+HTTPACTION: ", 13))
+        {
+            char *saveptr;
+            char *field;
+            uint16_t status = 0;
+
+            csvfield((char *)line + 13, &saveptr); /* Method */
+            field = csvfield(NULL, &saveptr);
+
+            if (field)
+                status = atoi(field);
+
+            printf("GSM: HTTP status %u\r\n", status);
+            gsm_finish_operation(status >= 200 && status < 300);
+        }
+        else if (!strcmp_p(line, "ERROR") || !strncmp_p(line, "+CME ERROR", 10))
+        {
+            gsm_finish_operation(false);
+        }
+
+        // Anything else is a blank line or an unsolicited result code (+CMTI,
+        // RING...) arriving while the request is out. The abort timer covers
+        // a result that never comes.
+    }
+#endif /* _GSM_GPRS_ */
 
 done:
     gsm_reset_buffer();
@@ -366,6 +435,56 @@ static void gsm_process_sms(uint8_t state, char *meta, char *message)
 
     //printf("gsm_process_sms: '%s' '%s'\r\n", _g_receive_buffer, _g_message_buffer);
 
+#ifdef _GSM_PDU_MODE_
+    char status[4];
+    int16_t message_index = _g_last_index;
+    pdu_concat_t concat;
+
+    // +CMGR: <stat>,[<alpha>],<length> or +CMGL: <index>,<stat>,[<alpha>],<length>
+    if (state == GSM_STATE_AWAIT_READ_SMS_TEXT)
+    {
+        flags = csvfield(meta, &saveptr);
+
+        if (!strncmp_p(flags, "+CMGR: ", 7))
+            flags += 7;
+    }
+    else
+    {
+        index = csvfield(meta, &saveptr);
+
+        if (!strncmp_p(index, "+CMGL: ", 7))
+            index += 7;
+
+        message_index = atoi(index);
+        flags = csvfield(NULL, &saveptr);
+    }
+
+    strncpy(status, flags ? flags : "", sizeof(status) - 1);
+    status[sizeof(status) - 1] = 0;
+
+    // The meta line is finished with, so the sender goes in the back half of
+    // it. Clear of the 'OK' which follows, like the text mode fields.
+    from = &meta[MAX_RX_BUFFER / 2];
+
+    if (!pdu_decode_deliver(message, _g_rx_index / 2, MAX_SMS_BUFFER, from, MAX_RX_BUFFER / 2, &concat))
+    {
+        printf("GSM: ERROR: Failed to decode PDU\r\n");
+        *from = 0;
+        *message = 0;
+    }
+    else if (concat.total > 1)
+    {
+        // Not reassembled. A part on its own would be parsed as a whole
+        // command, so it's passed up empty and deleted unread.
+        printf("GSM: Dropping part %u of %u (ref %u). Concatenated messages aren't supported\r\n",
+            concat.part, concat.total, concat.ref);
+        *message = 0;
+    }
+
+    if (_g_current_callback.readsms_cb.success_callback)
+        _g_current_callback.readsms_cb.success_callback(_g_current_callback.readsms_cb.data,
+            message_index, from, status, message);
+#else
     if (state == GSM_STATE_AWAIT_READ_SMS_TEXT)
     {
         uint8_t len;
@@ -399,6 +518,7 @@ static void gsm_process_sms(uint8_t state, char *meta, char *message)
     if (_g_current_callback.readsms_cb.success_callback)
         _g_current_callback.readsms_cb.success_callback(_g_current_callback.readsms_cb.data,
             state == GSM_STATE_AWAIT_READ_SMS_TEXT ? _g_last_index : atoi(index), from, flags, message);
+#endif /* _GSM_PDU_MODE_ */
     
     if (state == GSM_STATE_AWAIT_READ_SMS_TEXT)
     {
@@ -415,8 +535,20 @@ static void gsm_process_sms(uint8_t state, char *meta, char *message)
 }
 
 void gsm_send_sms(const char *recipient, const char *message, gsm_cb_t *callback)
+{
+    gsm_send_sms_part(recipient, message, 0, 1, 1, callback);
+}
+
+/*
+ * Sends one segment of a concatenated message. The modem builds the UDH from
+ * the reference, part number (1 based) and total. A lone part goes as normal.
+ */
+void gsm_send_sms_part(const char *recipient, const char *message, uint8_t ref, uint8_t part, uint8_t total, gsm_cb_t *callback)
 {
     char send_buf[64];
+#ifdef _GSM_PDU_MODE_
+    uint8_t len;
+#endif /* _GSM_PDU_MODE_ */
 
     if (_g_gsm_state != GSM_STATE_READY)
     {
@@ -428,9 +560,33 @@ void gsm_send_sms(const char *recipient, const char *message, gsm_cb_t *callback
     if (callback)
         memcpy(&_g_current_callback, callback, sizeof(gsm_cb_t));
     
-    sprintf(send_buf, "AT+CMGS=\"%s\"\r", recipient);
-    strncpy(_g_message_buffer, message, MAX_SMS);
-    _g_message_buffer[MAX_SMS] = 0;
+#ifdef _GSM_PDU_MODE_
+    // Builds its own concatenation header, so it's AT+CMGS regardless
+    len = pdu_encode_submit(_g_message_buffer, sizeof(_g_message_buffer), recipient, message, ref, part, total);
+
+    if (!len)
+    {
+        memset(&_g_current_callback, 0, sizeof(gsm_cb_t));
+        if (callback)
+            callback->fail_callback(callback->data);
+        return;
+    }
+
+    sprintf(send_buf, "AT+CMGS=%u\r", len);
+#else
+    if (total > 1)
+    {
+        sprintf(send_buf, "AT+CMGSEX=\"%s\",%u,%u,%u\r", recipient, ref, part, total);
+        strncpy(_g_message_buffer, message, MAX_SMS_SEGMENT);
+        _g_message_buffer[MAX_SMS_SEGMENT] = 0;
+    }
+    else
+    {
+        sprintf(send_buf, "AT+CMGS=\"%s\"\r", recipient);
+        strncpy(_g_message_buffer, message, MAX_SMS);
+        _g_message_buffer[MAX_SMS] = 0;
+    }
+#endif /* _GSM_PDU_MODE_ */
 
     gsm_update_state(GSM_STATE_AWAIT_SEND_SMS_INPUT);
     gsm_puts(send_buf);
@@ -472,7 +628,11 @@ void gsm_read_unread_sms(gsm_readsms_cb_t *callback)
     if (callback)
         memcpy(&_g_current_callback, callback, sizeof(gsm_readsms_cb_t));
 
+#ifdef _GSM_PDU_MODE_
+    sprintf(send_buf, "AT+CMGL=4\r");
+#else
     sprintf(send_buf, "AT+CMGL=\"ALL\"\r");
+#endif /* _GSM_PDU_MODE_ */
     gsm_update_state(GSM_STATE_AWAIT_READ_ALL_SMS_META);
     gsm_puts(send_buf);
 }
@@ -514,3 +674,81 @@ void gsm_delete_sms(int index, gsm_cb_t *callback)
     gsm_update_state(GSM_STATE_AWAIT_RESPONSE);
     gsm_puts(send_buf);
 }
+
+bool gsm_ready(void)
+{
+    return _g_gsm_state == GSM_STATE_READY;
+}
+
+#ifdef _GSM_GPRS_
+/*
+ * Sends a preformatted AT command (including the trailing \r) and waits for
+ * OK. For the bearer and HTTP set up, where the commands carry config strings
+ * too long for the usual local buffers.
+ */
+void gsm_command(const char *command, gsm_cb_t *callback)
+{
+    if (_g_gsm_state != GSM_STATE_READY)
+    {
+        if (callback)
+            callback->fail_callback(callback->data);
+        return;
+    }
+
+    if (callback)
+        memcpy(&_g_current_callback, callback, sizeof(gsm_cb_t));
+
+    gsm_update_state(GSM_STATE_AWAIT_RESPONSE);
+    gsm_puts(command);
+}
+
+void gsm_write(const char *str)
+{
+    gsm_puts(str);
+}
+
+/*
+ * Starts an HTTP body upload of exactly len bytes. The writer is called once
+ * the modem asks for the data, and must gsm_write() all of it.
+ */
+void gsm_http_data(uint16_t len, void (*writer)(void), gsm_cb_t *callback)
+{
+    char send_buf[64];
+
+    if (_g_gsm_state != GSM_STATE_READY)
+    {
+        if (callback)
+            callback->fail_callback(callback->data);
+        return;
+    }
+
+    if (callback)
+        memcpy(&_g_current_callback, callback, sizeof(gsm_cb_t));
+
+    _g_http_writer = writer;
+
+    sprintf(send_buf, "AT+HTTPDATA=%u,10000\r", len);
+    gsm_update_state(GSM_STATE_AWAIT_HTTP_DOWNLOAD);
+    gsm_puts(send_buf);
+}
+
+/* POSTs the uploaded body. Succeeds on a 2xx status from the server */
+void gsm_http_action(gsm_cb_t *callback)
+{
+    char send_buf[64];
+
+    if (_g_gsm_state != GSM_STATE_READY)
+    {
+        if (callback)
+            callback->fail_callback(callback->data);
+        return;
+    }
+
+    if (callback)
+        memcpy(&_g_current_callback, callback, sizeof(gsm_cb_t));
+
+    sprintf(send_buf, "AT+HTTPACTION=1\r");
+    gsm_update_state(GSM_STATE_AWAIT_HTTP_ACTION);
+    gsm_puts(send_buf);
+}
+#endif /* _GSM_GPRS_ */
@@ -20,6 +20,7 @@
 #define __GSM_H__
 
 #define MAX_SMS 160
+#define MAX_SMS_SEGMENT 153 /* Less the concatenation header */
 
 typedef struct
 {
@@ -39,10 +40,18 @@ typedef struct
 void gsm_init(void (*ready_callback)(void));
 void gsm_process(void);
 void gsm_send_sms(const char *recipient, const char *message, gsm_cb_t *callback);
+void gsm_send_sms_part(const char *recipient, const char *message, uint8_t ref, uint8_t part, uint8_t total, gsm_cb_t *callback);
 void gsm_read_unread_sms(gsm_readsms_cb_t *callback);
 void gsm_read_sms(int index, gsm_readsms_cb_t *callback);
 void gsm_delete_read_sms(gsm_cb_t *callback);
 void gsm_delete_sms(int index, gsm_cb_t *callback);
 void gsm_delete_unread_sms(gsm_cb_t *callback);
+bool gsm_ready(void);
+#ifdef _GSM_GPRS_
+void gsm_command(const char *command, gsm_cb_t *callback);
+void gsm_write(const char *str);
+void gsm_http_data(uint16_t len, void (*writer)(void), gsm_cb_t *callback);
+void gsm_http_action(gsm_cb_t *callback);
+#endif /* _GSM_GPRS_ */
 
 #endif /* __GSM_H__ */
\ No newline at end of file
@@ -25,13 +25,17 @@
 #include <avr/io.h>
 #include <util/twi.h>
 #include <util/delay.h>
+#include <avr/interrupt.h>
 
+#include "timeout.h"
 #include "i2c.h"
 
 #define I2C_PRESCALER 1
 #define I2C_READ    1
 #define I2C_WRITE   0
 
+static volatile uint8_t _g_i2c_error;
+
 void i2c_init(uint16_t freq_khz)
 {
     TWSR = 0;
@@ -77,12 +81,22 @@ uint8_t i2c_start_wait(uint8_t addr)
 
         // wait until transmission completed
         if (!i2c_sync())
+        {
+            _g_i2c_error = I2C_ERR_TIMEOUT;
             break;
+        }
 
         // check value of TWI Status Register. Mask prescaler bits.
         twst = TW_STATUS & 0xF8;
         if ((twst != TW_START) && (twst != TW_REP_START))
+        {
+            // lost the bus to noise or another master. Don't spin on it forever
+            _g_i2c_error = I2C_ERR_ARB_LOST;
+            if (!(retry--))
+                break;
+
             continue;
+        }
 
         // send device address
         TWDR = addr;
@@ -90,13 +104,17 @@ uint8_t i2c_start_wait(uint8_t addr)
 
         // wail until transmission completed
         if (!i2c_sync())
+        {
+            _g_i2c_error = I2C_ERR_TIMEOUT;
             break;
+        }
 
         // check value of TWI Status Register. Mask prescaler bits.
         twst = TW_STATUS & 0xF8;
-        if ((twst == TW_MT_SLA_NACK) || (twst == TW_MR_DATA_NACK))
+        if ((twst == TW_MT_SLA_NACK) || (twst == TW_MR_SLA_NACK))
         {
             /* device busy, send stop condition to terminate write operation */
+            _g_i2c_error = I2C_ERR_NACK;
             if (!i2c_wait_stop())
                 continue;
 
@@ -122,12 +140,19 @@ static bool i2c_byte_out(uint8_t data)
     TWCR = _BV(TWINT) | _BV(TWEN);
 
     // wait until transmission completed
-    i2c_sync();
+    if (!i2c_sync())
+    {
+        _g_i2c_error = I2C_ERR_TIMEOUT;
+        return false;
+    }
 
     // check value of TWI Status Register. Mask prescaler bits
     twst = TW_STATUS & 0xF8;
     if (twst != TW_MT_DATA_ACK)
+    {
+        _g_i2c_error = (twst == TW_MT_ARB_LOST) ? I2C_ERR_ARB_LOST : I2C_ERR_NACK;
         return false;
+    }
 
     return true;
 }
@@ -138,6 +163,8 @@ static bool i2c_read_ack(uint8_t *ret)
     TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWEA);
     result = i2c_sync();
     *ret = TWDR;
+    if (!result)
+        _g_i2c_error = I2C_ERR_TIMEOUT;
     return result;
 }
 
@@ -147,73 +174,293 @@ static bool i2c_read_nack(uint8_t *ret)
     TWCR = _BV(TWINT) | _BV(TWEN);
     result = i2c_sync();
     *ret = TWDR;
+    if (!result)
+        _g_i2c_error = I2C_ERR_TIMEOUT;
     return result;
 }
 
-#ifdef _I2C_XFER_
+/* Why the last transfer failed. One of I2C_ERR_xxx */
+uint8_t i2c_error(void)
+{
+    return _g_i2c_error;
+}
 
-bool i2c_read(uint8_t addr, uint8_t reg, uint8_t *ret)
+static bool i2c_write_phase(uint8_t addr, const uint8_t *data, uint8_t len)
 {
-    if (!i2c_start_wait(addr << 1 | I2C_WRITE))
-        goto fail;
+    if (!i2c_start_wait((addr << 1) | I2C_WRITE))
+        return false;
 
-    if (!i2c_byte_out(reg))
-        goto fail;
+    while (len--)
+    {
+        if (!i2c_byte_out(*data++))
+            return false;
+    }
 
-    if (!i2c_start_wait((addr << 1 | I2C_READ)))
-        goto fail;
+    return true;
+}
 
-    if (!i2c_read_nack(ret))
-        goto fail;
+#ifdef _I2C_ASYNC_
 
-    return i2c_wait_stop();
-fail:
-    i2c_wait_stop();
-    return false;
+/*
+ * Interrupt driven master. Transfers are queued as descriptors and run back
+ * to back from the TWI interrupt: an optional write, then an optional read
+ * after a repeated START. Callbacks are run from i2c_process() in the main
+ * loop, never from the interrupt. A descriptor and its buffers belong to the
+ * engine from i2c_queue() until its callback (or until its state changes,
+ * without one).
+ */
+
+#define I2C_ASYNC_RETRIES       50      /* SLA NACKs, while the device is busy */
+#define I2C_ASYNC_TIMEOUT       3       /* Ticks */
+
+typedef struct
+{
+    i2c_xfer_t *pending[I2C_QUEUE_LEN];
+    i2c_xfer_t *done[I2C_QUEUE_LEN];
+    volatile uint8_t head;              /* Pending. Interrupt removes */
+    uint8_t tail;                       /* Pending. Main loop adds */
+    uint8_t done_head;                  /* Done. Main loop removes */
+    volatile uint8_t done_tail;         /* Done. Interrupt adds */
+    uint8_t pos;
+    uint8_t retries;
+    bool reading;
+    uint8_t watch;
+    int32_t started;
+} i2c_async_t;
+
+static i2c_async_t _g_i2c;
+
+static void i2c_async_setup(i2c_async_t *en)
+{
+    i2c_xfer_t *xfer = en->pending[en->head % I2C_QUEUE_LEN];
+
+    en->pos = 0;
+    en->retries = I2C_ASYNC_RETRIES;
+    en->reading = (!xfer->wr_len && xfer->rd_len);
 }
 
-bool i2c_write(uint8_t addr, uint8_t reg, uint8_t data)
+/* Interrupts off. Ends the transfer at the head and starts the next one */
+static void i2c_async_next(i2c_async_t *en, uint8_t state)
 {
-    if (!i2c_start_wait((addr << 1) | I2C_WRITE))
-        goto fail;
+    i2c_xfer_t *xfer = en->pending[en->head % I2C_QUEUE_LEN];
 
-    if (!i2c_byte_out(reg))
-        goto fail;
+    if (xfer->callback)
+        en->done[en->done_tail++ % I2C_QUEUE_LEN] = xfer;
 
-    if (!i2c_byte_out(data))
-        goto fail;
+    en->head++;
 
-    return i2c_wait_stop();
-fail:
-    i2c_wait_stop();
-    return false;
+    /* Last touch. Without a callback the owner may be waiting on this */
+    xfer->state = state;
+
+    if (en->head != en->tail)
+    {
+        i2c_async_setup(en);
+        TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+    }
+    else
+    {
+        TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+    }
 }
 
-#endif /* _I2C_XFER_ */
+ISR(TWI_vect)
+{
+    i2c_async_t *en = &_g_i2c;
+    i2c_xfer_t *xfer = en->pending[en->head % I2C_QUEUE_LEN];
 
-#ifdef _I2C_XFER_BYTE_
+    switch (TW_STATUS & 0xF8)
+    {
+        case TW_START:
+        case TW_REP_START:
+            TWDR = (xfer->addr << 1) | (en->reading ? I2C_READ : I2C_WRITE);
+            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+            break;
+        case TW_MT_SLA_ACK:
+        case TW_MT_DATA_ACK:
+            if (en->pos < xfer->wr_len)
+            {
+                TWDR = xfer->wr[en->pos++];
+                TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+            }
+            else if (xfer->rd_len)
+            {
+                en->pos = 0;
+                en->reading = true;
+                TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+            }
+            else
+            {
+                i2c_async_next(en, I2C_XFER_DONE);
+            }
+            break;
+        case TW_MR_DATA_ACK:
+            xfer->rd[en->pos++] = TWDR;
+            /* Fall through */
+        case TW_MR_SLA_ACK:
+            /* NACK the last byte */
+            if (en->pos + 1 < xfer->rd_len)
+                TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+            else
+                TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+            break;
+        case TW_MR_DATA_NACK:
+            xfer->rd[en->pos] = TWDR;
+            i2c_async_next(en, I2C_XFER_DONE);
+            break;
+        case TW_MT_SLA_NACK:
+        case TW_MR_SLA_NACK:
+            /* Device busy, as in i2c_start_wait(). STOP, then start over */
+            if (en->retries--)
+            {
+                en->pos = 0;
+                en->reading = (!xfer->wr_len && xfer->rd_len);
+                TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+                break;
+            }
+            /* Fall through */
+        case TW_MT_DATA_NACK:
+            _g_i2c_error = I2C_ERR_NACK;
+            i2c_async_next(en, I2C_XFER_FAILED);
+            break;
+        default: /* Arbitration lost or a bus error */
+            _g_i2c_error = I2C_ERR_ARB_LOST;
+            i2c_async_next(en, I2C_XFER_FAILED);
+            break;
+    }
+}
 
-bool i2c_read_byte(uint8_t addr, uint8_t *ret)
+/* The interrupt can't tell a stuck bus from a slow one */
+static void i2c_async_watchdog(i2c_async_t *en)
 {
-    if (!i2c_start_wait((addr << 1) | I2C_READ))
-        goto fail;
+    g_irq_disable();
 
-    if (!i2c_read_nack(ret))
-        goto fail;
+    if (en->head != en->tail)
+    {
+        if (en->head != en->watch)
+        {
+            en->watch = en->head;
+            en->started = get_tick_count();
+        }
+        else if ((get_tick_count() - en->started) > I2C_ASYNC_TIMEOUT)
+        {
+            TWCR = 0; /* Let go of the bus */
+            _g_i2c_error = I2C_ERR_TIMEOUT;
+            i2c_async_next(en, I2C_XFER_FAILED);
+        }
+    }
 
-    return i2c_wait_stop();
-fail:
-    i2c_wait_stop();
-    return false;
+    g_irq_enable();
 }
 
-bool i2c_write_byte(uint8_t addr, uint8_t data)
+/* False when the queue is full. Room is kept for callbacks yet to be run */
+bool i2c_queue(i2c_xfer_t *xfer)
 {
-    if (!i2c_start_wait((addr << 1) | I2C_WRITE))
-        goto fail;
+    i2c_async_t *en = &_g_i2c;
+    uint16_t timeout = 1000;
+    bool queued = false;
 
-    if (!i2c_byte_out(data))
-        goto fail;
+    g_irq_disable();
+
+    if ((uint8_t)(en->tail - en->head) + (uint8_t)(en->done_tail - en->done_head) < I2C_QUEUE_LEN)
+    {
+        xfer->state = I2C_XFER_QUEUED;
+        en->pending[en->tail % I2C_QUEUE_LEN] = xfer;
+
+        if (en->tail++ == en->head)
+        {
+            /* The last transfer's STOP may still be going out */
+            while ((TWCR & _BV(TWSTO)) && timeout)
+            {
+                _delay_us(1);
+                timeout--;
+            }
+
+            en->watch = en->head;
+            en->started = get_tick_count();
+            i2c_async_setup(en);
+            TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN) | _BV(TWIE);
+        }
+
+        queued = true;
+    }
+
+    g_irq_enable();
+    return queued;
+}
+
+/* From the main loop. Runs the callbacks of finished transfers */
+void i2c_process(void)
+{
+    i2c_async_t *en = &_g_i2c;
+    i2c_xfer_t *xfer;
+
+    i2c_async_watchdog(en);
+
+    while (en->done_head != en->done_tail)
+    {
+        xfer = en->done[en->done_head % I2C_QUEUE_LEN];
+        en->done_head++;
+        xfer->callback(xfer->state == I2C_XFER_DONE, xfer->data);
+    }
+}
+
+/* Waits out the queue before using the TWI without the interrupt */
+static void i2c_claim(void)
+{
+    while (_g_i2c.head != _g_i2c.tail)
+        i2c_async_watchdog(&_g_i2c);
+}
+
+/* Blocking. Queues the transfer and waits for it */
+static bool i2c_transfer(uint8_t addr, const uint8_t *wr, uint8_t wr_len, uint8_t *rd, uint8_t rd_len)
+{
+    i2c_xfer_t xfer;
+
+    xfer.addr = addr;
+    xfer.wr = wr;
+    xfer.wr_len = wr_len;
+    xfer.rd = rd;
+    xfer.rd_len = rd_len;
+    xfer.callback = NULL;
+
+    if (!i2c_queue(&xfer))
+        return false;
+
+    while (xfer.state == I2C_XFER_QUEUED)
+        i2c_async_watchdog(&_g_i2c);
+
+    return (xfer.state == I2C_XFER_DONE);
+}
+
+#else
+
+#define i2c_claim()
+
+static bool i2c_transfer(uint8_t addr, const uint8_t *wr, uint8_t wr_len, uint8_t *rd, uint8_t rd_len)
+{
+    if (wr_len || !rd_len)
+    {
+        if (!i2c_write_phase(addr, wr, wr_len))
+            goto fail;
+    }
+
+    if (rd_len)
+    {
+        if (!i2c_start_wait((addr << 1) | I2C_READ))
+            goto fail;
+
+        while (rd_len > 1)
+        {
+            if (!i2c_read_ack(rd))
+                goto fail;
+
+            rd++;
+            rd_len--;
+        }
+
+        if (!i2c_read_nack(rd))
+            goto fail;
+    }
 
     return i2c_wait_stop();
 fail:
@@ -221,23 +468,51 @@ fail:
     return false;
 }
 
+#endif /* _I2C_ASYNC_ */
+
+#ifdef _I2C_XFER_
+
+bool i2c_read(uint8_t addr, uint8_t reg, uint8_t *ret)
+{
+    return i2c_transfer(addr, &reg, 1, ret, 1);
+}
+
+bool i2c_write(uint8_t addr, uint8_t reg, uint8_t data)
+{
+    uint8_t buf[2] = { reg, data };
+
+    return i2c_transfer(addr, buf, 2, NULL, 0);
+}
+
+#endif /* _I2C_XFER_ */
+
+#ifdef _I2C_XFER_BYTE_
+
+bool i2c_read_byte(uint8_t addr, uint8_t *ret)
+{
+    return i2c_transfer(addr, NULL, 0, ret, 1);
+}
+
+bool i2c_write_byte(uint8_t addr, uint8_t data)
+{
+    return i2c_transfer(addr, &data, 1, NULL, 0);
+}
+
 #endif /* _I2C_XFER_BYTE_ */
 
 #ifdef _I2C_XFER_MANY_
 
+/* Register and data aren't in one buffer, so this one stays polled */
 bool i2c_write_buf(uint8_t addr, uint8_t reg, uint8_t *data, uint8_t len)
 {
-    uint8_t i;
-
-    if (!i2c_start_wait((addr << 1) | I2C_WRITE))
-        goto fail;
+    i2c_claim();
 
-    if (!i2c_byte_out(reg))
+    if (!i2c_write_phase(addr, &reg, 1))
         goto fail;
 
-    for (i = 0; i < len; i++)
+    while (len--)
     {
-        if (!i2c_byte_out(*(data + i)))
+        if (!i2c_byte_out(*data++))
             goto fail;
     }
 
@@ -249,25 +524,77 @@ fail:
 
 bool i2c_read_buf(uint8_t addr, uint8_t reg, uint8_t *ret, uint8_t len)
 {
-    if (!i2c_start_wait(addr << 1 | I2C_WRITE))
-        goto fail;
+    return i2c_transfer(addr, &reg, 1, ret, len);
+}
 
-    if (!i2c_byte_out(reg))
-        goto fail;
+#endif /* _I2C_XFER_MANY_ */
 
-    if (!i2c_start_wait((addr << 1 | I2C_READ)))
-        goto fail;
+#ifdef _I2C_XFER_X16_
+
+bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data)
+{
+    uint8_t buf[3] = { reg, data >> 8, data & 0xFF };
+
+    return i2c_transfer(addr, buf, 3, NULL, 0);
+}
+
+bool i2c_read16(uint8_t addr, uint8_t reg, uint16_t *ret)
+{
+    uint8_t buf[2];
+
+    if (!i2c_transfer(addr, &reg, 1, buf, 2))
+        return false;
+
+    *ret = ((uint16_t)buf[0] << 8) | buf[1];
+    return true;
+}
 
-    while (len > 1)
+#endif /* _I2C_XFER_X16_ */
+
+#ifdef _I2C_DS2482_SPECIAL_
+
+/*
+ * The DS2482 helpers below keep hold of the bus from one phase to the next
+ * with a repeated START, rather than a STOP and a fresh START per phase.
+ * They poll the TWI directly, so wait for the queue to empty first.
+ */
+
+/* Re-reads the status register with ACKs until the mask bits clear */
+static bool i2c_poll_phase(uint8_t addr, uint8_t mask, uint8_t *ret, uint8_t attempts)
+{
+    uint8_t status;
+
+    if (!i2c_start_wait((addr << 1) | I2C_READ))
+        return false;
+
+    while (attempts--)
     {
-        if (!i2c_read_ack(ret))
-            goto fail;
-                
-        ret++;
-        len--;
+        if (!i2c_read_ack(&status))
+            return false;
+
+        if (!(status & mask))
+            break;
     }
 
-    if (!i2c_read_nack(ret))
+    if (!i2c_read_nack(&status))
+        return false;
+
+    *ret = status;
+
+    if (status & mask)
+    {
+        _g_i2c_error = I2C_ERR_BUSY;
+        return false;
+    }
+
+    return true;
+}
+
+bool i2c_await_flag(uint8_t addr, uint8_t mask, uint8_t *ret, uint8_t attempts)
+{
+    i2c_claim();
+
+    if (!i2c_poll_phase(addr, mask, ret, attempts))
         goto fail;
 
     return i2c_wait_stop();
@@ -276,22 +603,24 @@ fail:
     return false;
 }
 
-#endif /* _I2C_XFER_MANY_ */
-
-#ifdef _I2C_XFER_X16_
+/* Command, then a single byte back from wherever it left the read pointer */
+bool i2c_write_read(uint8_t addr, const uint8_t *data, uint8_t len, uint8_t *ret)
+{
+    return i2c_transfer(addr, data, len, ret, 1);
+}
 
-bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data)
+/*
+ * 1-Wire command, then poll the status register until it's done. The DS2482
+ * leaves its read pointer on the status register after any 1-Wire command.
+ */
+bool i2c_write_await_flag(uint8_t addr, const uint8_t *data, uint8_t len, uint8_t mask, uint8_t *ret, uint8_t attempts)
 {
-    if (!i2c_start_wait((addr << 1) | I2C_WRITE))
-        goto fail;
-    
-    if (!i2c_byte_out(reg))
-        goto fail;
+    i2c_claim();
 
-    if (!i2c_byte_out(*((uint8_t *)&data + 1)))
+    if (!i2c_write_phase(addr, data, len))
         goto fail;
 
-    if (!i2c_byte_out(*((uint8_t *)&data)))
+    if (!i2c_poll_phase(addr, mask, ret, attempts))
         goto fail;
 
     return i2c_wait_stop();
@@ -300,21 +629,30 @@ fail:
     return false;
 }
 
-bool i2c_read16(uint8_t addr, uint8_t reg, uint16_t *ret)
+/*
+ * As above, then move the read pointer and read the register it now points
+ * at. A whole 1-Wire byte read in one I2C transaction.
+ */
+bool i2c_write_await_read(uint8_t addr, const uint8_t *data, uint8_t len, uint8_t mask,
+    const uint8_t *ptr, uint8_t *ret, uint8_t attempts)
 {
-    if (!i2c_start_wait(addr << 1 | I2C_WRITE))
+    uint8_t status;
+
+    i2c_claim();
+
+    if (!i2c_write_phase(addr, data, len))
         goto fail;
 
-    if (!i2c_byte_out(reg))
+    if (!i2c_poll_phase(addr, mask, &status, attempts))
         goto fail;
 
-    if (!i2c_start_wait((addr << 1 | I2C_READ)))
+    if (!i2c_write_phase(addr, ptr, 2))
         goto fail;
 
-    if (!i2c_read_ack((uint8_t *)ret + 1))
+    if (!i2c_start_wait((addr << 1) | I2C_READ))
         goto fail;
 
-    if (!i2c_read_nack((uint8_t *)ret))
+    if (!i2c_read_nack(ret))
         goto fail;
 
     return i2c_wait_stop();
@@ -323,36 +661,43 @@ fail:
     return false;
 }
 
-#endif /* _I2C_XFER_X16_ */
+#endif /* _I2C_DS2482_SPECIAL_ */
 
-#ifdef _I2C_DS2482_SPECIAL_
+#ifdef _I2C_BRUTEFORCE_RESET_
 
-bool i2c_await_flag(uint8_t addr, uint8_t mask, uint8_t *ret, uint8_t attempts)
+#define I2C_SCL     PD0
+#define I2C_SDA     PD1
+
+/*
+ * Frees a bus held by a slave that was cut off mid byte. SCL is clocked by
+ * hand until the slave lets go of SDA (9 clocks at most), then a START and
+ * a STOP reset every slave's bus state. Both lines are only ever pulled low
+ * or released.
+ */
+void i2c_bruteforce_reset(void)
 {
-    uint8_t status;
+    uint8_t i;
 
-    if (!i2c_start_wait((addr << 1) | I2C_READ))
-        goto fail;
+    i2c_claim();
 
-    while (attempts--)
-    {
-        if (!i2c_read_ack(&status))
-            goto fail;
+    TWCR = 0;
+    DDRD &= ~(_BV(I2C_SCL) | _BV(I2C_SDA));
+    PORTD &= ~(_BV(I2C_SCL) | _BV(I2C_SDA));
 
-        if (!(status & mask))
-            break;
+    for (i = 0; i < 9 && !(PIND & _BV(I2C_SDA)); i++)
+    {
+        DDRD |= _BV(I2C_SCL);
+        _delay_us(5);
+        DDRD &= ~_BV(I2C_SCL);
+        _delay_us(5);
     }
 
-    if (!i2c_read_nack(&status))
-        goto fail;
-
-    i2c_wait_stop();
-    *ret = status;
-    return !(status & mask);
+    DDRD |= _BV(I2C_SDA);
+    _delay_us(5);
+    DDRD &= ~_BV(I2C_SDA);
+    _delay_us(5);
 
-fail:
-    i2c_wait_stop();
-    return false;
+    TWCR = _BV(TWEN);
 }
 
-#endif /* _I2C_DS2482_SPECIAL_ */
+#endif /* _I2C_BRUTEFORCE_RESET_ */
@@ -35,7 +35,37 @@
 #endif
 */
 
+#define I2C_ERR_NACK            0
+#define I2C_ERR_ARB_LOST        1       /* Or a bus error */
+#define I2C_ERR_TIMEOUT         2       /* SCL held, or the TWI never finished */
+#define I2C_ERR_BUSY            3       /* i2c_await_flag() ran out of attempts */
+
 void i2c_init(uint16_t freq_khz);
+uint8_t i2c_error(void);
+
+#ifdef _I2C_ASYNC_
+#define I2C_QUEUE_LEN           4       /* Power of two */
+
+#define I2C_XFER_QUEUED         0
+#define I2C_XFER_DONE           1
+#define I2C_XFER_FAILED         2
+
+/* Write wr_len bytes, then read rd_len after a repeated START. Either may be 0 */
+typedef struct
+{
+    uint8_t addr;
+    const uint8_t *wr;
+    uint8_t wr_len;
+    uint8_t *rd;
+    uint8_t rd_len;
+    void (*callback)(bool success, void *data);
+    void *data;
+    volatile uint8_t state;
+} i2c_xfer_t;
+
+bool i2c_queue(i2c_xfer_t *xfer);
+void i2c_process(void);
+#endif /* _I2C_ASYNC_ */
 
 #ifdef _I2C_BRUTEFORCE_RESET_
 void i2c_bruteforce_reset(void);
@@ -67,6 +97,10 @@ bool i2c_write16(uint8_t addr, uint8_t reg, uint16_t data);
 
 #ifdef _I2C_DS2482_SPECIAL_
 bool i2c_await_flag(uint8_t addr, uint8_t mask, uint8_t *ret, uint8_t attempts);
+bool i2c_write_read(uint8_t addr, const uint8_t *data, uint8_t len, uint8_t *ret);
+bool i2c_write_await_flag(uint8_t addr, const uint8_t *data, uint8_t len, uint8_t mask, uint8_t *ret, uint8_t attempts);
+bool i2c_write_await_read(uint8_t addr, const uint8_t *data, uint8_t len, uint8_t mask,
+    const uint8_t *ptr, uint8_t *ret, uint8_t attempts);
 #endif /* _I2C_DS2482_SPECIAL_ */
 
 #endif /* __I2C_H__ */
\ No newline at end of file
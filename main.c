@@ -43,22 +43,59 @@
 #include "timer.h"
 #include "timeout.h"
 #include "smshistory.h"
+#include "tempfilter.h"
+#include "gprs.h"
+
+#define ALARM_NONE      0
+#define ALARM_LOW       1
+#define ALARM_HIGH      2
+
+#define ALARM_PACK(state, candidate) ((state) | ((candidate) << 4))
+
+#define TELEMETRY_VERSION   1
+#define TELEMETRY_SMS_MAX   (((MAX_SMS - 2) / 4) * 3) /* Record bytes that fit one SMS after "T:" and base64 */
 
 char _g_dotBuf[MAX_DESC];
-char _g_sms_buf[MAX_SMS + 1];
 
 typedef struct
 {
     sys_config_t *config;
-    uint8_t sensor_ids[MAX_SENSORS][DS18X20_ROMCODE_SIZE];
     uint8_t num_sensors;
+    uint8_t sensor_bound[SENSOR_SET_BYTES];
+    uint8_t parasite[SENSOR_SET_BYTES];
+    uint16_t converting;
+    uint8_t parasite_next;
+    uint8_t resolution;
+    uint8_t read_set[SENSOR_SET_BYTES];
+    uint16_t dead_buses;                  /* Given up on until the next cycle */
+#ifdef _DS18X20_ALARM_SEARCH_
+    uint8_t alarm_cycle;
+#endif /* _DS18X20_ALARM_SEARCH_ */
+#ifdef _DS2482_ASYNC_
+    uint8_t read_index;
+    bool read_retried;
+#endif /* _DS2482_ASYNC_ */
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+    ds18x20_search_t search;
+    uint8_t search_bus;
+    uint8_t search_seen[SENSOR_SET_BYTES];
+    uint8_t sensor_missing[SENSOR_SET_BYTES];
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
     int16_t temp_result[MAX_SENSORS];
-    uint16_t temp_state;
+    uint8_t temp_state[SENSOR_SET_BYTES];
+    uint8_t alarm[MAX_SENSORS];           /* State in the low nibble, candidate in the high */
+    uint16_t alarm_since[MAX_SENSORS];
     int8_t measure_timer;
     int8_t readtemp_timer;
+    int8_t convpoll_timer;
+#ifdef _DS18X20_POLL_CONVERSION_
+    uint16_t conv_pending;
+#endif /* _DS18X20_POLL_CONVERSION_ */
     uint16_t mains_counter;
     uint16_t mains_result;
     uint8_t last_portb;
+    uint16_t battery_voltage;
+    uint16_t telemetry_seq;
 } sys_runstate_t;
 
 sys_config_t _g_cfg;
@@ -69,10 +106,37 @@ FILE uart_str = FDEV_SETUP_STREAM(print_char, NULL, _FDEV_SETUP_RW);
 static void io_init(void);
 static char *dots_for(const char *str);
 static void print_temp(uint8_t temp, int16_t result, const char *desc, uint8_t nl);
+static void bind_sensors(sys_runstate_t *rs);
+static int8_t match_sensor(sys_runstate_t *rs, uint8_t bus, uint8_t *rom);
+static int8_t enrol_sensor(sys_runstate_t *rs, uint8_t bus, uint8_t *rom);
+static uint8_t sensor_bus(sys_runstate_t *rs, uint8_t i);
+static void bus_sensors(sys_runstate_t *rs, uint8_t bus, uint8_t *set);
+static uint16_t buses_in_use(sys_runstate_t *rs);
+static uint16_t parasite_buses(sys_runstate_t *rs);
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+static void search_step(sys_runstate_t *rs);
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
+static bool configure_sensor(sys_runstate_t *rs, uint8_t i, uint8_t *bits);
+static void reconfigure_sensors(sys_runstate_t *rs);
 static void start_measure(void *param);
 static void read_sensors(void *param);
+#ifdef _DS2482_ASYNC_
+static void read_next_sensor(sys_runstate_t *rs);
+static void sensor_read_done(bool success, int16_t temp, void *data);
+#endif /* _DS2482_ASYNC_ */
+#ifdef _DS18X20_ALARM_SEARCH_
+static void alarmed_sensors(sys_runstate_t *rs, uint8_t *set);
+#endif /* _DS18X20_ALARM_SEARCH_ */
+static bool recover_bus(sys_runstate_t *rs, uint8_t bus);
+static void store_reading(sys_runstate_t *rs, uint8_t i, bool success, int16_t temp);
+static void process_readings(sys_runstate_t *rs);
+#ifdef _DS18X20_POLL_CONVERSION_
+static void poll_conversion(void *param);
+#endif /* _DS18X20_POLL_CONVERSION_ */
+static uint8_t evaluate_thresholds(sys_runstate_t *rs, uint8_t i);
 static void check_ctrld(void *param);
 static void check_mains(void *param);
+uint8_t telemetry_record(uint8_t *data, uint8_t max);
 
 ISR(PCINT0_vect)
 {
@@ -88,6 +152,7 @@ ISR(TIMER1_OVF_vect)
 int main(void)
 {
     uint8_t i;
+    uint8_t present = 0;
     sys_runstate_t *rs = &_g_rs;
     sys_config_t *config = &_g_cfg;
     rs->config = config;
@@ -102,7 +167,13 @@ int main(void)
     stdout = &uart_str;
 
     rs->mains_counter = 0;
-    rs->temp_state = 0;
+    memset(rs->temp_state, 0, SENSOR_SET_BYTES);
+    rs->battery_voltage = 0;
+    rs->telemetry_seq = 0;
+    rs->parasite_next = 0;
+#ifdef _DS18X20_ALARM_SEARCH_
+    rs->alarm_cycle = 0;
+#endif /* _DS18X20_ALARM_SEARCH_ */
 
     adc_init();
     i2c_init(400);
@@ -114,36 +185,61 @@ int main(void)
     configuration_bootprompt(config);
 
     sms_init(config);
+#ifdef _GSM_GPRS_
+    gprs_init(config);
+#endif /* _GSM_GPRS_ */
 
     for (i = 0; i < MAX_SENSORS; i++)
+    {
         rs->temp_result[i] = 0;
+        rs->alarm[i] = ALARM_PACK(ALARM_NONE, ALARM_NONE);
+        temp_filter_reset(i);
+    }
 
-    if (ds18x20_search_sensors(&rs->num_sensors, rs->sensor_ids))
-        printf("\r\nFound %u of %u maximum sensors\r\n", rs->num_sensors, MAX_SENSORS);
-    else
-        printf("\r\nHardware error searching for sensors\r\n");
+    bind_sensors(rs);
 
     if (rs->num_sensors == 0)
         printf("No sensors found.\r\n");
 
-    if (rs->num_sensors != config->expected_sensors)
+    rs->resolution = rs->num_sensors ? 9 : 12;
+
+    for (i = 0; i < rs->num_sensors; i++)
     {
-        if (sms_can_send_message())
+        uint8_t bits;
+
+        if (!bitset_test(rs->sensor_bound, i))
+            continue;
+
+        if (configure_sensor(rs, i, &bits))
         {
-            sprintf(_g_sms_buf, "Temperature sensor failure. There should be %u sensors, but %u were found", config->expected_sensors, rs->num_sensors);
-            sms_try_send(MESSAGE_STARTUP, 0, _g_sms_buf);
+            present++;
         }
+        else
+        {
+            printf("Sensor %u not responding\r\n", i + 1);
+            bits = 12;
+        }
+
+        if (bits > rs->resolution)
+            rs->resolution = bits;
     }
 
+    timeout_init();
+    sms_history_init();
+
+    if (present != config->expected_sensors)
+        sms_alert(MESSAGE_STARTUP, 0, present);
+
     CLRWDT();
 
     printf("Press Ctrl+D at any time to reset\r\n");
-
-    timeout_init();
-    sms_history_init();
     
     rs->measure_timer = timeout_create(100, true, false, &start_measure, (void *)rs);
-    rs->readtemp_timer = timeout_create(760, false, false, &read_sensors, (void *)rs);
+    // Reads wait for the slowest sensor
+    rs->readtemp_timer = timeout_create(DS18B20_TCONV(rs->resolution) + 10, false, false, &read_sensors, (void *)rs);
+#ifdef _DS18X20_POLL_CONVERSION_
+    rs->convpoll_timer = timeout_create(10, false, false, &poll_conversion, (void *)rs);
+#endif /* _DS18X20_POLL_CONVERSION_ */
     timeout_create(50, true, true, &check_ctrld, (void *)rs);
     timeout_create(1000, true, true, &check_mains, (void *)rs);
 
@@ -153,6 +249,12 @@ int main(void)
         timeout_check();
         gsm_process();
         sms_process();
+#ifdef _I2C_ASYNC_
+        i2c_process();
+#endif /* _I2C_ASYNC_ */
+#ifdef _GSM_GPRS_
+        gprs_process();
+#endif /* _GSM_GPRS_ */
     }
 }
 
@@ -179,95 +281,738 @@ static void io_init(void)
     USBCON &= ~_BV(USBE);
 }
 
+/*
+ * Slot i of config->temp_sensors[] belongs to the ROM code stored in it, so
+ * names and thresholds stay with their device when others fail or are added.
+ * Once every expected slot is bound they're addressed directly and the search
+ * is skipped. Otherwise every bus is searched, devices are matched to their
+ * slots and new ones are bound to the first free slot.
+ */
+static void bind_sensors(sys_runstate_t *rs)
+{
+    sys_config_t *config = rs->config;
+    ds18x20_search_t search;
+    char rom[(DS18X20_ROMCODE_SIZE * 2) + 1];
+    uint8_t seen[SENSOR_SET_BYTES];
+    uint8_t num_found;
+    int8_t result;
+    uint8_t bus;
+    int8_t slot;
+    uint8_t i;
+
+    rs->num_sensors = 0;
+    memset(rs->sensor_bound, 0, SENSOR_SET_BYTES);
+    memset(rs->parasite, 0, SENSOR_SET_BYTES);
+    memset(seen, 0, SENSOR_SET_BYTES);
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+    memset(rs->sensor_missing, 0, SENSOR_SET_BYTES);
+    memset(rs->search_seen, 0, SENSOR_SET_BYTES);
+    rs->search_bus = 0;
+    ds18x20_search_start(&rs->search);
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
+
+    for (i = 0; i < MAX_SENSORS; i++)
+    {
+        if (!config->temp_sensors[i].rom[0])
+            continue;
+
+        bitset_set(rs->sensor_bound, i);
+        rs->num_sensors = i + 1;
+    }
+
+    for (i = 0; i < config->expected_sensors; i++)
+    {
+        if (!bitset_test(rs->sensor_bound, i))
+            break;
+    }
+
+    if (i && i == config->expected_sensors)
+    {
+        printf("\r\nUsing %u bound sensors\r\n", config->expected_sensors);
+        return;
+    }
+
+    // One device at a time, so there's no table of them on the stack
+    for (bus = 0; bus < ow_num_buses(); bus++)
+    {
+        ds18x20_search_start(&search);
+        result = ow_select_bus(bus) ? DS18X20_SEARCH_CONTINUE : DS18X20_SEARCH_ERROR;
+        num_found = 0;
+
+        while (result == DS18X20_SEARCH_CONTINUE || result == DS18X20_SEARCH_FOUND)
+        {
+            result = ds18x20_search_next(&search);
+
+            if (result != DS18X20_SEARCH_FOUND)
+                continue;
+
+            num_found++;
+            slot = match_sensor(rs, bus, search.id);
+
+            if (slot < 0)
+                slot = enrol_sensor(rs, bus, search.id);
+
+            if (slot >= 0)
+                bitset_set(seen, slot);
+        }
+
+        if (result == DS18X20_SEARCH_ERROR)
+        {
+            printf("\r\nHardware error searching for sensors on bus %u\r\n", bus);
+            // Whatever is bound there keeps its slot
+            bus_sensors(rs, bus, seen);
+            continue;
+        }
+
+        printf("\r\nFound %u sensors on bus %u\r\n", num_found, bus);
+    }
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (bitset_test(rs->sensor_bound, i) && !bitset_test(seen, i))
+        {
+            format_hex(rom, rs->config->temp_sensors[i].rom, DS18X20_ROMCODE_SIZE);
+            printf("Missing sensor %u (%s)\r\n", i + 1, rom);
+        }
+    }
+
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+    memcpy(rs->sensor_missing, rs->sensor_bound, SENSOR_SET_BYTES);
+    bitset_andnot(rs->sensor_missing, seen, SENSOR_SET_BYTES);
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
+}
+
+/* Slot bound to this ROM code, or -1. A sensor moved to another bus keeps its slot. */
+static int8_t match_sensor(sys_runstate_t *rs, uint8_t bus, uint8_t *rom)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < MAX_SENSORS; slot++)
+    {
+        if (bitset_test(rs->sensor_bound, slot) &&
+            !memcmp(rs->config->temp_sensors[slot].rom, rom, DS18X20_ROMCODE_SIZE))
+        {
+            if (sensor_bus(rs, slot) != bus)
+            {
+                printf("Sensor %u moved to bus %u\r\n", slot + 1, bus);
+                rs->config->temp_sensors[slot].bus = bus;
+                save_configuration(rs->config);
+            }
+
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+/* Binds a new sensor to the first free slot and saves it. Returns the slot, or -1 if full. */
+static int8_t enrol_sensor(sys_runstate_t *rs, uint8_t bus, uint8_t *rom)
+{
+    char buf[(DS18X20_ROMCODE_SIZE * 2) + 1];
+    uint8_t slot;
+
+    format_hex(buf, rom, DS18X20_ROMCODE_SIZE);
+
+    for (slot = 0; slot < MAX_SENSORS; slot++)
+    {
+        if (!bitset_test(rs->sensor_bound, slot))
+            break;
+    }
+
+    if (slot == MAX_SENSORS)
+    {
+        printf("Unknown sensor %s. No free slots\r\n", buf);
+        return -1;
+    }
+
+    memcpy(rs->config->temp_sensors[slot].rom, rom, DS18X20_ROMCODE_SIZE);
+    rs->config->temp_sensors[slot].bus = bus;
+    bitset_set(rs->sensor_bound, slot);
+    rs->num_sensors = max_(rs->num_sensors, slot + 1);
+    temp_filter_reset(slot);
+
+    save_configuration(rs->config);
+
+    printf("New sensor %s on bus %u bound to slot %u\r\n", buf, bus, slot + 1);
+    return slot;
+}
+
+/* The configuration keeps each bound sensor's bus up to date, so there's no copy of it here */
+static uint8_t sensor_bus(sys_runstate_t *rs, uint8_t i)
+{
+    return rs->config->temp_sensors[i].bus;
+}
+
+/* Adds the bound sensors on one bus to a set */
+static void bus_sensors(sys_runstate_t *rs, uint8_t bus, uint8_t *set)
+{
+    uint8_t i;
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (bitset_test(rs->sensor_bound, i) && sensor_bus(rs, i) == bus)
+            bitset_set(set, i);
+    }
+}
+
+/* Buses with at least one bound sensor, as a bus mask */
+static uint16_t buses_in_use(sys_runstate_t *rs)
+{
+    uint16_t mask = 0;
+    uint8_t i;
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (bitset_test(rs->sensor_bound, i))
+            mask |= (1U << sensor_bus(rs, i));
+    }
+
+    return mask;
+}
+
+/* Buses with at least one parasite powered sensor, as a bus mask */
+static uint16_t parasite_buses(sys_runstate_t *rs)
+{
+    uint16_t mask = 0;
+    uint8_t i;
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (bitset_test(rs->sensor_bound, i) && bitset_test(rs->parasite, i))
+            mask |= (1U << sensor_bus(rs, i));
+    }
+
+    return mask;
+}
+
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+/*
+ * One search pass per measurement cycle, so sensors plugged in at runtime are
+ * picked up without the loop ever waiting on a whole search. The buses are
+ * searched in turn. Bound sensors not seen by a complete sweep of all of them
+ * are reported missing until they come back.
+ */
+static void search_step(sys_runstate_t *rs)
+{
+    int8_t result = DS18X20_SEARCH_ERROR;
+    uint8_t bits;
+    int8_t slot;
+    uint8_t i;
+
+    if (ow_select_bus(rs->search_bus))
+        result = ds18x20_search_next(&rs->search);
+
+    switch (result)
+    {
+        case DS18X20_SEARCH_FOUND:
+            slot = match_sensor(rs, rs->search_bus, rs->search.id);
+
+            if (slot < 0)
+            {
+                slot = enrol_sensor(rs, rs->search_bus, rs->search.id);
+                if (slot < 0)
+                    return;
+
+                if (!configure_sensor(rs, slot, &bits))
+                    bits = 12;
+
+                if (bits > rs->resolution)
+                {
+                    rs->resolution = bits;
+                    timeout_set_interval(rs->readtemp_timer, DS18B20_TCONV(bits) + 10);
+                }
+            }
+
+            bitset_set(rs->search_seen, slot);
+            return;
+        case DS18X20_SEARCH_CONTINUE:
+            return;
+        case DS18X20_SEARCH_ERROR:
+            // A failed bus can't say who's gone, so its sensors stay as they were
+            for (i = 0; i < rs->num_sensors; i++)
+            {
+                if (sensor_bus(rs, i) == rs->search_bus && !bitset_test(rs->sensor_missing, i))
+                    bitset_set(rs->search_seen, i);
+            }
+            break;
+    }
+
+    ds18x20_search_start(&rs->search);
+
+    if (++rs->search_bus < ow_num_buses())
+        return;
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        bool missing = bitset_test(rs->sensor_bound, i) && !bitset_test(rs->search_seen, i);
+
+        if (missing && !bitset_test(rs->sensor_missing, i))
+            printf("Sensor %u missing\r\n", i + 1);
+        if (!missing && bitset_test(rs->sensor_missing, i))
+            printf("Sensor %u found again\r\n", i + 1);
+    }
+
+    memcpy(rs->sensor_missing, rs->sensor_bound, SENSOR_SET_BYTES);
+    bitset_andnot(rs->sensor_missing, rs->search_seen, SENSOR_SET_BYTES);
+    memset(rs->search_seen, 0, SENSOR_SET_BYTES);
+    rs->search_bus = 0;
+}
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
+
+/*
+ * Resolution and alarm limits go to the sensor. TH/TL are whole degrees and
+ * compared against the integer part of the reading, so they're rounded
+ * inwards: the sensor flags an alarm no later than the thresholds would.
+ */
+static bool configure_sensor(sys_runstate_t *rs, uint8_t i, uint8_t *bits)
+{
+    tempsensor_config_t *sensor = &rs->config->temp_sensors[i];
+    int16_t high = temp_from_decicelsius(sensor->high_threshold);
+    int16_t low = temp_from_decicelsius(sensor->low_threshold);
+    bool parasite;
+    int8_t th;
+    int8_t tl;
+
+    th = high >> TEMP_FRAC_BITS;
+    tl = (low + (TEMP_ONE - 1)) >> TEMP_FRAC_BITS;
+
+    *bits = sensor->resolution;
+
+    if (!ow_select_bus(sensor->bus))
+        return false;
+
+    if (!ds18x20_parasite_powered(sensor->rom, &parasite))
+        return false;
+
+    if (parasite)
+    {
+        if (!bitset_test(rs->parasite, i))
+            printf("Sensor %u is parasite powered\r\n", i + 1);
+
+        bitset_set(rs->parasite, i);
+    }
+    else
+    {
+        bitset_clr(rs->parasite, i);
+    }
+
+    return ds18x20_configure(sensor->rom, bits, th, tl, parasite);
+}
+
+/*
+ * Sensors whose thresholds or resolution were changed by SMS. The new TH/TL
+ * go to the sensor straight away, otherwise the alarm search wouldn't see a
+ * lowered threshold until the next full read. Retried until it responds.
+ * A sensor unbound by SMS is dropped here too.
+ */
+static void reconfigure_sensors(sys_runstate_t *rs)
+{
+    uint8_t bits;
+    uint8_t i;
+
+    if (bitset_empty(_g_sensors_changed, SENSOR_SET_BYTES))
+        return;
+
+    for (i = 0; i < MAX_SENSORS; i++)
+    {
+        if (!bitset_test(_g_sensors_changed, i))
+            continue;
+
+        // Unbound by SMS. Its ROM code is gone, so it can't be read any more.
+        if (bitset_test(rs->sensor_bound, i) && !rs->config->temp_sensors[i].rom[0])
+        {
+            printf("Sensor %u unbound\r\n", i + 1);
+            bitset_clr(rs->sensor_bound, i);
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+            bitset_clr(rs->sensor_missing, i);
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
+            sms_alert_clear(MESSAGE_TEMP_RANGE_HIGH, i);
+            sms_alert_clear(MESSAGE_TEMP_RANGE_LOW, i);
+            sms_alert_clear(MESSAGE_TEMP_STATE, i);
+        }
+
+        // Not bound, nothing to write to. It's configured when it turns up.
+        if (i < rs->num_sensors && bitset_test(rs->sensor_bound, i))
+        {
+            if (!configure_sensor(rs, i, &bits))
+                continue;
+
+            printf("Sensor %u reconfigured\r\n", i + 1);
+
+            if (bits > rs->resolution)
+            {
+                rs->resolution = bits;
+                timeout_set_interval(rs->readtemp_timer, DS18B20_TCONV(bits) + 10);
+            }
+        }
+
+        bitset_clr(_g_sensors_changed, i);
+    }
+}
+
+/*
+ * Conversions on every bus are started before any are read. Buses with parasite
+ * powered sensors are converted last, with the strong pull-up, which only lasts
+ * until their DS2482's next 1-Wire operation. So only one of them per DS2482
+ * converts each cycle, in turn, and nothing is polled while they do.
+ */
 static void start_measure(void *param)
 {
     sys_runstate_t *rs = (sys_runstate_t *)param;
+    uint16_t buses = buses_in_use(rs);
+    uint16_t parasite = parasite_buses(rs);
+    uint16_t masters = 0;
+    uint8_t next = 0xFF;
+    uint8_t bus;
     uint8_t i;
 
+#ifdef _DS18X20_BACKGROUND_SEARCH_
+    // Bus is quiet between a read and the next conversion
+    search_step(rs);
+#endif /* _DS18X20_BACKGROUND_SEARCH_ */
+
+    reconfigure_sensors(rs);
+
+    rs->converting = buses & ~parasite;
+
+#ifdef _DS18X20_BROADCAST_CONVERT_
+    for (i = 0; i < ow_num_buses(); i++)
+    {
+        if ((rs->converting & (1U << i)) && ow_select_bus(i))
+            ds18x20_start_meas_all(false);
+    }
+#else
     for (i = 0; i < rs->num_sensors; i++)
-        ds18x20_start_meas(rs->sensor_ids[i]);
+    {
+        if (bitset_test(rs->sensor_bound, i) && (rs->converting & (1U << sensor_bus(rs, i))) &&
+            ow_select_bus(sensor_bus(rs, i)))
+            ds18x20_start_meas(rs->config->temp_sensors[i].rom);
+    }
+#endif /* _DS18X20_BROADCAST_CONVERT_ */
 
+    // Always broadcast: addressing the next sensor would end the pull-up on the last
+    for (i = 0; i < ow_num_buses(); i++)
+    {
+        bus = (rs->parasite_next + i) % ow_num_buses();
+
+        if (!(parasite & (1U << bus)))
+            continue;
+
+        if (masters & (1U << ow_bus_master(bus)))
+        {
+            // Its turn is next cycle
+            if (next == 0xFF)
+                next = bus;
+            continue;
+        }
+
+        masters |= (1U << ow_bus_master(bus));
+
+        if (ow_select_bus(bus) && ds18x20_start_meas_all(true))
+            rs->converting |= (1U << bus);
+    }
+
+    rs->parasite_next = (next == 0xFF) ? 0 : next;
+
+    // Fixed timer stays as the timeout if completion is never seen
     timeout_start(rs->readtemp_timer);
+#ifdef _DS18X20_POLL_CONVERSION_
+    rs->conv_pending = rs->converting;
+    if (rs->conv_pending && !masters)
+        timeout_start(rs->convpoll_timer);
+#endif /* _DS18X20_POLL_CONVERSION_ */
 }
 
+#ifdef _DS18X20_POLL_CONVERSION_
+/* Reads start once every bus has finished converting */
+static void poll_conversion(void *param)
+{
+    sys_runstate_t *rs = (sys_runstate_t *)param;
+    bool done;
+    uint8_t i;
+
+    for (i = 0; i < ow_num_buses(); i++)
+    {
+        if (!(rs->conv_pending & (1U << i)))
+            continue;
+
+        // A bus error here is left to the timeout, and the reads will report it
+        if (ow_select_bus(i) && ds18x20_conversion_done(&done) && done)
+            rs->conv_pending &= ~(1U << i);
+    }
+
+    if (rs->conv_pending)
+    {
+        timeout_start(rs->convpoll_timer);
+        return;
+    }
+
+    timeout_stop(rs->readtemp_timer);
+    read_sensors(rs);
+}
+#endif /* _DS18X20_POLL_CONVERSION_ */
+
 static void read_sensors(void *param)
 {
     sys_runstate_t *rs = (sys_runstate_t *)param;
-    uint16_t battery_voltage;
+#ifdef _DS18X20_ALARM_SEARCH_
+    uint8_t alarmed[SENSOR_SET_BYTES];
+#endif /* _DS18X20_ALARM_SEARCH_ */
+    uint16_t skipped;
     uint8_t i;
 
+#ifdef _DS18X20_POLL_CONVERSION_
+    timeout_stop(rs->convpoll_timer);
+#endif /* _DS18X20_POLL_CONVERSION_ */
+
+    memcpy(rs->read_set, rs->sensor_bound, SENSOR_SET_BYTES);
+    skipped = parasite_buses(rs) & ~rs->converting;
+
+    // Parasite buses waiting their turn keep their last readings
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (skipped & (1U << sensor_bus(rs, i)))
+            bitset_clr(rs->read_set, i);
+    }
+
+#ifdef _DS18X20_ALARM_SEARCH_
+    // In between full reads, only sensors that need attention are read
+    if (++rs->alarm_cycle < DS18X20_FULL_READ_CYCLES)
+    {
+        alarmed_sensors(rs, alarmed);
+        bitset_and(rs->read_set, alarmed, SENSOR_SET_BYTES);
+    }
+    else
+    {
+        rs->alarm_cycle = 0;
+    }
+#endif /* _DS18X20_ALARM_SEARCH_ */
+
+    rs->dead_buses = 0;
+
+#ifdef _DS2482_ASYNC_
+    rs->read_index = 0;
+    rs->read_retried = false;
+    read_next_sensor(rs);
+#else
     for (i = 0; i < rs->num_sensors; i++)
     {
+        uint8_t bus = sensor_bus(rs, i);
         int16_t reading_temp;
+        bool success = false;
 
-        if (ds18x20_read_decicelsius(rs->sensor_ids[i], &reading_temp))
-        {
-            rs->temp_result[i] = reading_temp;
-            rs->temp_state |= (1 << i);
-        }
-        else
+        if (!bitset_test(rs->read_set, i))
+            continue;
+
+        if (!(rs->dead_buses & (1U << bus)))
         {
-            rs->temp_state &= ~(1 << i);
+            success = ow_select_bus(bus) && ds18x20_read_temp(rs->config->temp_sensors[i].rom, &reading_temp);
+
+            if (!success && recover_bus(rs, bus))
+                success = ow_select_bus(bus) && ds18x20_read_temp(rs->config->temp_sensors[i].rom, &reading_temp);
         }
+
+        store_reading(rs, i, success, reading_temp);
     }
 
-    for (i = 0; i < rs->num_sensors; i++)
+    process_readings(rs);
+#endif /* _DS2482_ASYNC_ */
+}
+
+#ifdef _DS2482_ASYNC_
+/*
+ * Sensors are read one after the other, each read running from the main loop
+ * so the modem is serviced in between. The last one processes the results.
+ */
+static void read_next_sensor(sys_runstate_t *rs)
+{
+    uint8_t bus;
+
+    while (rs->read_index < rs->num_sensors)
     {
-        if ((rs->temp_state & (1 << i)) == (1 << i))
-        {
-            print_temp(i, rs->temp_result[i], rs->config->temp_sensors[i].name, (i == 0));
+        bus = sensor_bus(rs, rs->read_index);
 
-            if (rs->temp_result[i] > rs->config->temp_sensors[i].high_threshold)
+        if (bitset_test(rs->read_set, rs->read_index))
+        {
+            if (!(rs->dead_buses & (1U << bus)))
             {
-                if (sms_can_send_message())
-                {
-                    fixedpoint_sign(rs->temp_result[i], current);
-                    fixedpoint_sign(rs->config->temp_sensors[i].high_threshold, threshold);
-
-                    sprintf(_g_sms_buf, "Sensor '%s' is above threshold: current: %s%u.%u threshold: %s%u.%u",
-                        rs->config->temp_sensors[i].name,
-                        fixedpoint_arg(rs->temp_result[i], current),
-                        fixedpoint_arg(rs->config->temp_sensors[i].high_threshold, threshold)
-                    );
-                    sms_try_send(MESSAGE_TEMP_RANGE_HIGH, i, _g_sms_buf);
-                }
-                else
+                if (ow_select_bus(bus) &&
+                    ds18x20_read_temp_async(rs->config->temp_sensors[rs->read_index].rom, &sensor_read_done, rs))
+                    return;
+
+                if (!rs->read_retried && recover_bus(rs, bus))
                 {
-                    printf("Not sending high threshold SMS. Buffer not available\r\n");
+                    rs->read_retried = true;
+                    continue;
                 }
             }
 
-            if (rs->temp_result[i] < rs->config->temp_sensors[i].low_threshold)
+            store_reading(rs, rs->read_index, false, 0);
+        }
+
+        rs->read_index++;
+        rs->read_retried = false;
+    }
+
+    process_readings(rs);
+}
+
+static void sensor_read_done(bool success, int16_t temp, void *data)
+{
+    sys_runstate_t *rs = (sys_runstate_t *)data;
+
+    // Same sensor again, once, if the bus had to be recovered
+    if (!success && !rs->read_retried && recover_bus(rs, sensor_bus(rs, rs->read_index)))
+    {
+        rs->read_retried = true;
+        read_next_sensor(rs);
+        return;
+    }
+
+    store_reading(rs, rs->read_index, success, temp);
+    rs->read_index++;
+    rs->read_retried = false;
+    read_next_sensor(rs);
+}
+#endif /* _DS2482_ASYNC_ */
+
+#ifdef _DS18X20_ALARM_SEARCH_
+/*
+ * Sensors to read this cycle: those the alarm search turns up, plus any in or
+ * heading into an alarm state so they can clear through the hysteresis and
+ * dwell, any whose last read failed and any still filling their filter. The
+ * rest keep their last reading.
+ */
+static void alarmed_sensors(sys_runstate_t *rs, uint8_t *set)
+{
+    ds18x20_search_t search;
+    uint16_t buses = buses_in_use(rs);
+    int8_t result;
+    uint8_t bus;
+    int8_t slot;
+    uint8_t i;
+
+    for (i = 0; i < SENSOR_SET_BYTES; i++)
+        set[i] = ~rs->temp_state[i];
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (rs->alarm[i] != ALARM_PACK(ALARM_NONE, ALARM_NONE) ||
+            !temp_filter_settled(i, rs->config->temp_sensors[i].filter))
+            bitset_set(set, i);
+    }
+
+    for (bus = 0; bus < ow_num_buses(); bus++)
+    {
+        if (!(buses & (1U << bus)))
+            continue;
+
+        ds18x20_alarm_search_start(&search);
+        result = ow_select_bus(bus) ? DS18X20_SEARCH_CONTINUE : DS18X20_SEARCH_ERROR;
+
+        while (result == DS18X20_SEARCH_CONTINUE || result == DS18X20_SEARCH_FOUND)
+        {
+            result = ds18x20_search_next(&search);
+
+            if (result == DS18X20_SEARCH_FOUND)
             {
-                if (sms_can_send_message())
-                {
-                    fixedpoint_sign(rs->temp_result[i], current);
-                    fixedpoint_sign(rs->config->temp_sensors[i].low_threshold, threshold);
-
-                    sprintf(_g_sms_buf, "Sensor '%s' is below threshold: current: %s%u.%u threshold: %s%u.%u",
-                        rs->config->temp_sensors[i].name,
-                        fixedpoint_arg(rs->temp_result[i], current),
-                        fixedpoint_arg(rs->config->temp_sensors[i].low_threshold, threshold)
-                    );
-                    sms_try_send(MESSAGE_TEMP_RANGE_LOW, i, _g_sms_buf);
-                }
-                else
-                {
-                    printf("Not sending low threshold SMS. Buffer not available\r\n");
-                }
+                slot = match_sensor(rs, bus, search.id);
+                if (slot >= 0)
+                    bitset_set(set, slot);
             }
         }
+
+        // Can't tell who's alarming, so read everyone on this bus
+        if (result != DS18X20_SEARCH_DONE)
+            bus_sensors(rs, bus, set);
+    }
+}
+#endif /* _DS18X20_ALARM_SEARCH_ */
+
+/*
+ * A read that failed because the I2C bus or its master wedged gets the bus
+ * recovered and one more try. If recovery fails, or is backing off, every
+ * bus on that master is given up on for the rest of the cycle rather than
+ * each of its sensors timing out in turn.
+ */
+static bool recover_bus(sys_runstate_t *rs, uint8_t bus)
+{
+    uint8_t master;
+    uint8_t i;
+
+    if (!ow_bus_fault())
+        return false;
+
+    if (ow_recover())
+    {
+        printf("Recovered 1-Wire bus %u\r\n", bus);
+        return true;
+    }
+
+    master = ow_bus_master(bus);
+
+    for (i = 0; i < ow_num_buses(); i++)
+    {
+        if (ow_bus_master(i) == master)
+            rs->dead_buses |= (1U << i);
+    }
+
+    return false;
+}
+
+static void store_reading(sys_runstate_t *rs, uint8_t i, bool success, int16_t temp)
+{
+    if (success)
+    {
+        rs->temp_result[i] = temp_filter_add(i, temp, rs->config->temp_sensors[i].filter);
+        bitset_set(rs->temp_state, i);
+    }
+    else
+    {
+        bitset_clr(rs->temp_state, i);
+    }
+}
+
+static void process_readings(sys_runstate_t *rs)
+{
+    uint16_t battery_voltage;
+    uint8_t i;
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        // A sensor unbound since its read is dropped at the next measurement
+        if (!bitset_test(rs->sensor_bound, i) || !rs->config->temp_sensors[i].rom[0])
+            continue;
+
+        if (bitset_test(rs->temp_state, i))
+        {
+            uint8_t alarm;
+
+            print_temp(i, rs->temp_result[i], rs->config->temp_sensors[i].name, (i == 0));
+
+            // A new sensor keeps its alert state until its filter has enough readings to trust
+            if (temp_filter_settled(i, rs->config->temp_sensors[i].filter))
+                alarm = evaluate_thresholds(rs, i);
+            else
+                alarm = rs->alarm[i] & 0x0F;
+
+            if (alarm == ALARM_HIGH)
+                sms_alert(MESSAGE_TEMP_RANGE_HIGH, i, rs->temp_result[i]);
+            else
+                sms_alert_clear(MESSAGE_TEMP_RANGE_HIGH, i);
+
+            if (alarm == ALARM_LOW)
+                sms_alert(MESSAGE_TEMP_RANGE_LOW, i, rs->temp_result[i]);
+            else
+                sms_alert_clear(MESSAGE_TEMP_RANGE_LOW, i);
+
+            sms_alert_clear(MESSAGE_TEMP_STATE, i);
+        }
         else
         {
             printf("Error reading from sensor %u\r\n", i);
-            
-            if (sms_can_send_message())
-            {
-                sprintf(_g_sms_buf, "Lost connectivity to temperature sensor '%s'",
-                    rs->config->temp_sensors[i].name
-                );
-                sms_try_send(MESSAGE_TEMP_STATE, i, _g_sms_buf);
-            }
+            sms_alert(MESSAGE_TEMP_STATE, i, 0);
         }
     }
 
@@ -275,15 +1020,12 @@ static void read_sensors(void *param)
         printf("No sensors\r\n");
 
     battery_voltage = adc_read_battery();
+    rs->battery_voltage = battery_voltage;
 
     if (battery_voltage < BATTERY_VOLTAGE_LOW_THRESHOLD)
-    {
-        if (sms_can_send_message())
-        {
-            strcpy(_g_sms_buf, "Low battery alert");
-            sms_try_send(MESSAGE_LOW_BATTERY, 0, _g_sms_buf);
-        }
-    }
+        sms_alert(MESSAGE_LOW_BATTERY, 0, battery_voltage);
+    else
+        sms_alert_clear(MESSAGE_LOW_BATTERY, 0);
 
     printf("Mains frequency ...........: %u\r\n", rs->mains_result);
     printf("Battery voltage ...........: %u.%02u\r\n", fixedpoint_arg_u_2dp(battery_voltage));
@@ -291,6 +1033,54 @@ static void read_sensors(void *param)
     timeout_start(rs->measure_timer);
 }
 
+/*
+ * Thresholds are configured in tenths of a degree and converted to the
+ * readings' 1/16 degree units here. A converted copy would cost RAM per sensor
+ * and have to be kept in step with every way the configuration changes.
+ */
+static uint8_t evaluate_thresholds(sys_runstate_t *rs, uint8_t i)
+{
+    tempsensor_config_t *sensor = &rs->config->temp_sensors[i];
+    int16_t high = temp_from_decicelsius(sensor->high_threshold);
+    int16_t low = temp_from_decicelsius(sensor->low_threshold);
+    int16_t hysteresis = temp_from_decicelsius(sensor->hysteresis);
+    int16_t temp = rs->temp_result[i];
+    uint16_t now = (uint16_t)(get_tick_count() / TIMEOUT_TICK_PER_SECOND);
+    uint8_t state = rs->alarm[i] & 0x0F;
+    uint8_t candidate = rs->alarm[i] >> 4;
+    uint8_t wanted = ALARM_NONE;
+
+    // Once in alarm, the reading has to come back past the threshold by the hysteresis amount to clear it
+    if (state == ALARM_HIGH && temp > (high - hysteresis))
+        wanted = ALARM_HIGH;
+    else if (state == ALARM_LOW && temp < (low + hysteresis))
+        wanted = ALARM_LOW;
+    else if (temp > high)
+        wanted = ALARM_HIGH;
+    else if (temp < low)
+        wanted = ALARM_LOW;
+
+    if (wanted == state)
+    {
+        candidate = wanted;
+    }
+    else
+    {
+        // Change of state. It has to persist for the dwell time before it's acted upon.
+        if (candidate != wanted)
+        {
+            candidate = wanted;
+            rs->alarm_since[i] = now;
+        }
+
+        if ((uint16_t)(now - rs->alarm_since[i]) >= sensor->dwell)
+            state = wanted;
+    }
+
+    rs->alarm[i] = ALARM_PACK(state, candidate);
+    return state;
+}
+
 static void check_ctrld(void *param)
 {
     console_clear_oerr();
@@ -319,26 +1109,26 @@ static void check_mains(void *param)
 
     if (!rs->mains_result)
     {
-        if ((get_tick_count() / TIMEOUT_TICK_PER_SECOND) > MAINS_HOLDOFF_SECONDS && sms_can_send_message())
-        {
-            sprintf(_g_sms_buf, "Mains power has failed");
-            sms_try_send(MESSAGE_MAINS_STATE_OFF, 0, _g_sms_buf);
-        }
+        if ((get_tick_count() / TIMEOUT_TICK_PER_SECOND) > MAINS_HOLDOFF_SECONDS)
+            sms_alert(MESSAGE_MAINS_STATE_OFF, 0, 0);
     }
     if (temp_mains_result && !rs->mains_result)
     {
-        if ((get_tick_count() / TIMEOUT_TICK_PER_SECOND) > MAINS_HOLDOFF_SECONDS && sms_can_send_message())
-        {
-            sprintf(_g_sms_buf, "Mains power restored");
-            sms_try_send(MESSAGE_MAINS_STATE_ON, 0, _g_sms_buf);
-        }
+        if ((get_tick_count() / TIMEOUT_TICK_PER_SECOND) > MAINS_HOLDOFF_SECONDS)
+            sms_alert(MESSAGE_MAINS_STATE_ON, 0, 0);
     }
 
+    if (temp_mains_result)
+        sms_alert_clear(MESSAGE_MAINS_STATE_OFF, 0);
+    else
+        sms_alert_clear(MESSAGE_MAINS_STATE_ON, 0);
+
     rs->mains_result = temp_mains_result;
 }
 
-static void print_temp(uint8_t temp, int16_t dec, const char *desc, uint8_t nl)
+static void print_temp(uint8_t temp, int16_t result, const char *desc, uint8_t nl)
 {
+    int16_t dec = temp_to_decicelsius(result);
     fixedpoint_sign(dec, dec);
 
     printf("%sTemp %c (C) [%s] %s..: %s%u.%u\r\n",
@@ -357,43 +1147,130 @@ static char *dots_for(const char *str)
     return _g_dotBuf;
 }
 
-void status_response(char *sendbuffer)
+/*
+ * Fills one message segment with status lines, from 'line' up to 'end' (0 for
+ * no limit). Returns the line the next segment should start from, or 0 when
+ * there are none left. Each line is fitted at its longest, so readings which
+ * change between segments can't move where they split.
+ */
+uint8_t status_response(char *sendbuffer, uint8_t line, uint8_t end)
 {
-    char buf[20];
-    uint8_t i;
+    char buf[MAX_DESC + MAX_FDP + 4];
     sys_runstate_t *rs = &_g_rs;
+    uint8_t len = 0;
 
     sendbuffer[0] = 0;
-    for (i = 0; i < rs->num_sensors; i++)
+    for (; line < rs->num_sensors; line++)
     {
         char tempdesc[8];
+        char temp[MAX_FDP];
         const char *desc;
-        fixedpoint_sign(rs->temp_result[i], temp_result);
 
-        sprintf(tempdesc, "Temp%u", i + 1);
+        if (end && line == end)
+            return line;
+
+        sprintf(tempdesc, "Temp%u", line + 1);
 
-        desc = *(rs->config->temp_sensors[i].name) ? rs->config->temp_sensors[i].name : tempdesc;
+        desc = *(rs->config->temp_sensors[line].name) ? rs->config->temp_sensors[line].name : tempdesc;
 
-        if ((rs->temp_state & (1 << i)) == (1 << i))
+        // "name: " plus "Unknown" or a reading, both at most MAX_FDP - 1, and the newline
+        if ((len + strlen(desc) + 2 + (MAX_FDP - 1) + 1) > MAX_SMS_SEGMENT)
+            return line;
+
+        if (bitset_test(rs->temp_state, line))
         {
-            sprintf(buf, "%s: %s%u.%u\n", desc,
-                fixedpoint_arg(rs->temp_result[i], temp_result));
+            format_temp(temp, rs->temp_result[line]);
+            sprintf(buf, "%s: %s\n", desc, temp);
         }
         else
         {
             sprintf(buf, "%s: Unknown\n", desc);
         }
 
-        if ((strlen(sendbuffer) + strlen(buf)) >= (MAX_SMS))
-            return;
-
         strcat(sendbuffer, buf);
+        len += strlen(buf);
     }
 
-    sprintf(buf, "Power: %s", rs->mains_result > 0 ? "On" : "Off");
-
-    if ((strlen(sendbuffer) + strlen(buf)) >= (MAX_SMS))
-        return;
+    if ((end && line == end) || (len + strlen_P(PSTR("Power: Off"))) > MAX_SMS_SEGMENT)
+        return line;
 
+    sprintf(buf, "Power: %S", rs->mains_result > 0 ? PSTR("On") : PSTR("Off"));
     strcat(sendbuffer, buf);
+    return 0;
+}
+
+/*
+ * Machine readable status, base64 encoded after a "T:" prefix. Decoded by
+ * tools/telemetry.py. After a version byte, all fields are varints:
+ *
+ *   sequence, uptime (seconds), mains frequency, battery (centivolts),
+ *   sensor count, valid sensor bitmap, then one zigzag delta (0.1 degrees)
+ *   per valid sensor, each from the one before, the first from zero.
+ */
+void telemetry_response(char *sendbuffer)
+{
+    uint8_t data[MAX_TELEMETRY];
+    uint8_t len;
+
+    len = telemetry_record(data, TELEMETRY_SMS_MAX);
+
+    strcpy_P(sendbuffer, PSTR("T:"));
+    base64_encode(sendbuffer + 2, data, len);
+}
+
+/*
+ * The binary record behind telemetry_response(). Returns its length. Readings
+ * that would take it past max bytes are sent as invalid, which only happens
+ * to an SMS with a lot of sensors.
+ */
+uint8_t telemetry_record(uint8_t *data, uint8_t max)
+{
+    sys_runstate_t *rs = &_g_rs;
+    uint8_t valid[SENSOR_SET_BYTES];
+    uint8_t delta[5];
+    int16_t previous = 0;
+    int16_t reading;
+    uint8_t reserve;
+    uint8_t bitmap;
+    uint8_t dlen;
+    uint8_t len = 0;
+    uint8_t pos;
+    uint8_t i;
+
+    data[len++] = TELEMETRY_VERSION;
+    len += varint_encode(&data[len], rs->telemetry_seq++);
+    len += varint_encode(&data[len], get_tick_count() / TIMEOUT_TICK_PER_SECOND);
+    len += varint_encode(&data[len], rs->mains_result);
+    len += varint_encode(&data[len], rs->battery_voltage);
+    len += varint_encode(&data[len], rs->num_sensors);
+
+    // The valid bitmap isn't known until the deltas are in, so they go after the most it could take
+    memcpy(valid, rs->temp_state, SENSOR_SET_BYTES);
+    reserve = max_(1, (rs->num_sensors + 6) / 7);
+    pos = len + reserve;
+
+    for (i = 0; i < rs->num_sensors; i++)
+    {
+        if (!bitset_test(valid, i))
+            continue;
+
+        // Sent in tenths, as it always has been
+        reading = temp_to_decicelsius(rs->temp_result[i]);
+        dlen = varint_encode(delta, zigzag_encode(reading - previous));
+
+        if ((pos + dlen) > max)
+        {
+            bitset_clr(valid, i);
+            continue;
+        }
+
+        memcpy(&data[pos], delta, dlen);
+        pos += dlen;
+        previous = reading;
+    }
+
+    bitmap = varint_encode_bits(&data[len], valid, rs->num_sensors);
+    memmove(&data[len + bitmap], &data[len + reserve], pos - (len + reserve));
+
+    return pos - reserve + bitmap;
 }
\ No newline at end of file
@@ -23,6 +23,7 @@
 #define OW_MATCH_ROM    0x55
 #define OW_SKIP_ROM     0xCC
 #define OW_SEARCH_ROM   0xF0
+#define OW_ALARM_SEARCH 0xEC
 
 #define OW_SEARCH_FIRST 0xFF        /* Start new search */
 #define OW_PRESENCE_ERR 0xFF
@@ -35,10 +36,17 @@
 #define ow_init()
 #define ow_bus_reset(presense) owbitbang_bus_reset(presense)
 #define ow_command(cmd, id) owbitbang_command(cmd, id)
+#define ow_command_pullup(cmd, id) false    /* Needs a strong pull-up transistor */
 #define ow_read_byte(ret) ((*ret = owbitbang_byte_xch(0xFF)) | 1)
 #define ow_write_byte(data) (owbitbang_byte_xch(data) | 1)
 #define ow_rom_search(diff, id) owbitbang_rom_search(diff, id)
 #define ow_bus_idle() owbitbang_bus_idle()
+#define ow_num_buses() 1
+#define ow_select_bus(bus) true
+#define ow_bus_master(bus) 0
+#define ow_crc_error()
+#define ow_bus_fault() false
+#define ow_recover() false
 
 #endif /* _OW_BITBANG_ */
 
@@ -47,11 +55,19 @@
 #define ow_init() ds2482_init()
 #define ow_bus_reset(presense) ds2482_bus_reset(presense)
 #define ow_command(cmd, id) ds2482_command(cmd, id)
+#define ow_command_pullup(cmd, id) ds2482_command_pullup(cmd, id)
 #define ow_read_byte(ret) ds2482_read_byte(ret)
 #define ow_write_byte(data) ds2482_write_byte(data)
+#define ow_read_bit(ret) ds2482_read_bit(ret)
 #define ow_rom_search(diff, id) ds2482_rom_search(diff, id)
+#define ow_alarm_search(diff, id) ds2482_alarm_search(diff, id)
 #define ow_bus_idle() true
-#define ow_select_channel(channel) ds2482_select_channel(channel)
+#define ow_num_buses() ds2482_num_buses()
+#define ow_select_bus(bus) ds2482_select_bus(bus)
+#define ow_bus_master(bus) ds2482_bus_master(bus)
+#define ow_crc_error() ds2482_record_error(DS2482_ERR_CRC)
+#define ow_bus_fault() ds2482_bus_fault()
+#define ow_recover() ds2482_recover()
 
 #endif /* _OW_DS2482_ */
 
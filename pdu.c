@@ -0,0 +1,415 @@
+/*
+ *   File:   pdu.c
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 14:05
+ *
+ *   PDU mode codec. Builds SMS-SUBMIT PDUs in GSM 7-bit with an optional
+ *   concatenation header, and decodes SMS-DELIVER PDUs in GSM 7-bit, 8-bit or
+ *   UCS2 down to plain ASCII.
+ *
+ *   Everything is done in place in the caller's buffer. On the way out the
+ *   binary PDU is built at the start of the buffer then expanded to hex from
+ *   the end backwards. On the way in the GSM driver packs the hex to binary as
+ *   it arrives, and the user data is moved to the end of the buffer before
+ *   being unpacked to text at the start.
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "project.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "gsm.h"
+#include "pdu.h"
+
+#define PDU_TYPE_SUBMIT                0x01
+#define PDU_TYPE_DELIVER               0x00
+#define PDU_TYPE_MASK                  0x03
+#define PDU_UDHI                       0x40
+
+#define PDU_TOA_INTERNATIONAL          0x91
+#define PDU_TOA_UNKNOWN                0x81
+#define PDU_TOA_ALPHANUMERIC           0x50
+#define PDU_TOA_TON_MASK               0x70
+
+#define PDU_ALPHABET_GSM7              0
+#define PDU_ALPHABET_8BIT              1
+#define PDU_ALPHABET_UCS2              2
+
+#define PDU_IEI_CONCAT_8BIT            0x00
+#define PDU_IEI_CONCAT_16BIT           0x08
+
+#define PDU_SCTS_LEN                   7
+#define PDU_CONCAT_UDH_LEN             6
+
+#define GSM7_ESCAPE                    0x1B
+
+static const char _g_hex[] PROGMEM = "0123456789ABCDEF";
+
+static uint8_t pdu_ascii_to_gsm7(char c);
+static char pdu_gsm7_to_ascii(uint8_t c, bool escaped);
+static uint8_t pdu_alphabet(uint8_t dcs);
+
+uint8_t pdu_hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return 0;
+}
+
+/*
+ * Builds an SMS-SUBMIT as a hex string, ready to go after AT+CMGS. Returns the
+ * TPDU length (excluding the SMSC field) which AT+CMGS needs, or 0 if it
+ * won't fit. With total > 1 the text is limited to MAX_SMS_SEGMENT.
+ */
+uint8_t pdu_encode_submit(char *buffer, uint16_t size, const char *number, const char *text, uint8_t ref, uint8_t part, uint8_t total)
+{
+    uint8_t *pdu = (uint8_t *)buffer;
+    bool international = false;
+    uint8_t digits = 0;
+    uint8_t len = 0;
+    uint8_t udl;
+    uint16_t bitpos;
+    int16_t i;
+
+    if (*number == '+')
+    {
+        international = true;
+        number++;
+    }
+
+    /* Worst case is a full 160 septets with a 15 digit number */
+    if (size < (((16 + 140) * 2) + 1))
+        return 0;
+
+    memset(pdu, 0, size);
+
+    pdu[len++] = 0x00; /* Use the SMSC stored in the SIM */
+    pdu[len++] = PDU_TYPE_SUBMIT | (total > 1 ? PDU_UDHI : 0);
+    pdu[len++] = 0x00; /* Message reference assigned by the modem */
+    pdu[len++] = strlen(number);
+    pdu[len++] = international ? PDU_TOA_INTERNATIONAL : PDU_TOA_UNKNOWN;
+
+    /* Address in swapped semi-octets, padded with F */
+    for (; *number && digits < 20; number++, digits++)
+    {
+        if (digits & 1)
+        {
+            pdu[len] = (pdu[len] & 0x0F) | ((*number - '0') << 4);
+            len++;
+        }
+        else
+        {
+            pdu[len] = 0xF0 | (*number - '0');
+        }
+    }
+
+    if (digits & 1)
+        len++;
+
+    pdu[len++] = 0x00; /* PID */
+    pdu[len++] = 0x00; /* DCS: GSM 7-bit */
+
+    udl = len++;
+    bitpos = 0;
+
+    if (total > 1)
+    {
+        pdu[len++] = PDU_CONCAT_UDH_LEN - 1;
+        pdu[len++] = PDU_IEI_CONCAT_8BIT;
+        pdu[len++] = 3;
+        pdu[len++] = ref;
+        pdu[len++] = total;
+        pdu[len++] = part;
+
+        /* Text starts on the next septet boundary after the header */
+        bitpos = ((PDU_CONCAT_UDH_LEN * 8) + 6) / 7 * 7;
+    }
+
+    for (i = 0; *text && i < (total > 1 ? MAX_SMS_SEGMENT : MAX_SMS); text++, i++)
+    {
+        uint8_t septet = pdu_ascii_to_gsm7(*text);
+        uint8_t *octet = &pdu[(udl + 1) + (bitpos / 8)];
+        uint8_t shift = bitpos % 8;
+
+        octet[0] |= septet << shift;
+        if (shift > 1)
+            octet[1] |= septet >> (8 - shift);
+
+        bitpos += 7;
+    }
+
+    pdu[udl] = bitpos / 7;
+    len = (udl + 1) + ((bitpos + 7) / 8);
+
+    /* Expand to hex from the end, so nothing is overwritten before it's used */
+    for (i = len - 1; i >= 0; i--)
+    {
+        uint8_t octet = pdu[i];
+
+        buffer[(i * 2) + 1] = pgm_read_byte(&_g_hex[octet & 0x0F]);
+        buffer[i * 2] = pgm_read_byte(&_g_hex[octet >> 4]);
+    }
+
+    buffer[len * 2] = 0;
+
+    return len - 1;
+}
+
+/*
+ * Decodes a binary SMS-DELIVER of 'len' octets, in a buffer 'size' long. The
+ * text is left NUL terminated at the start of the buffer and the originating
+ * address is copied to 'from'. Characters with no ASCII equivalent become '?'.
+ */
+bool pdu_decode_deliver(char *buffer, uint16_t len, uint16_t size, char *from, uint8_t from_size, pdu_concat_t *concat)
+{
+    uint8_t *pdu = (uint8_t *)buffer;
+    uint16_t pos;
+    uint8_t first;
+    uint8_t digits;
+    uint8_t toa;
+    uint8_t alphabet;
+    uint8_t udl;
+    uint8_t header = 0;
+    uint16_t octets;
+    uint16_t i;
+    uint8_t *ud;
+    char *out = buffer;
+
+    concat->ref = 0;
+    concat->part = 1;
+    concat->total = 1;
+    *from = 0;
+
+    if (!len)
+        return false;
+
+    pos = 1 + pdu[0]; /* Skip SMSC */
+
+    if ((pos + 2) > len)
+        return false;
+
+    first = pdu[pos++];
+
+    if ((first & PDU_TYPE_MASK) != PDU_TYPE_DELIVER)
+        return false;
+
+    digits = pdu[pos++];
+    toa = pdu[pos++];
+
+    if ((pos + ((digits + 1) / 2)) > len)
+        return false;
+
+    /* Alphanumeric senders can't be recipients, so leave 'from' empty */
+    if ((toa & PDU_TOA_TON_MASK) != PDU_TOA_ALPHANUMERIC && (digits + 2) <= from_size)
+    {
+        if (toa == PDU_TOA_INTERNATIONAL)
+            *from++ = '+';
+
+        for (i = 0; i < digits; i++)
+        {
+            uint8_t digit = (pdu[pos + (i / 2)] >> ((i & 1) ? 4 : 0)) & 0x0F;
+
+            if (digit > 9)
+                break;
+
+            *from++ = '0' + digit;
+        }
+
+        *from = 0;
+    }
+
+    pos += (digits + 1) / 2;
+    pos++; /* PID */
+    alphabet = pdu_alphabet(pdu[pos++]);
+    pos += PDU_SCTS_LEN;
+
+    if (pos >= len)
+        return false;
+
+    udl = pdu[pos++];
+
+    if (alphabet == PDU_ALPHABET_GSM7)
+        octets = ((uint16_t)udl * 7 + 7) / 8;
+    else
+        octets = udl;
+
+    /* Truncated by the receive buffer. Decode what there is */
+    if ((pos + octets) > len)
+        octets = len - pos;
+
+    if (octets > (size - MAX_SMS - 1))
+        return false;
+
+    ud = (uint8_t *)&buffer[size - octets];
+    memmove(ud, &pdu[pos], octets);
+
+    if ((first & PDU_UDHI) && octets)
+    {
+        uint8_t hpos = 1;
+
+        header = ud[0] + 1;
+
+        while ((hpos + 2) <= header && header <= octets)
+        {
+            uint8_t iei = ud[hpos];
+            uint8_t ielen = ud[hpos + 1];
+
+            if ((hpos + 2 + ielen) > header)
+                break;
+
+            if (iei == PDU_IEI_CONCAT_8BIT && ielen == 3)
+            {
+                concat->ref = ud[hpos + 2];
+                concat->total = ud[hpos + 3];
+                concat->part = ud[hpos + 4];
+            }
+            else if (iei == PDU_IEI_CONCAT_16BIT && ielen == 4)
+            {
+                concat->ref = ((uint16_t)ud[hpos + 2] << 8) | ud[hpos + 3];
+                concat->total = ud[hpos + 4];
+                concat->part = ud[hpos + 5];
+            }
+
+            hpos += 2 + ielen;
+        }
+    }
+
+    if (alphabet == PDU_ALPHABET_GSM7)
+    {
+        bool escaped = false;
+        uint16_t bitpos = (header * 8 + 6) / 7 * 7;
+
+        for (i = bitpos / 7; i < udl && (bitpos / 8) < octets; i++, bitpos += 7)
+        {
+            uint8_t shift = bitpos % 8;
+            uint8_t septet = ud[bitpos / 8] >> shift;
+
+            if (shift > 1 && ((bitpos / 8) + 1) < octets)
+                septet |= ud[(bitpos / 8) + 1] << (8 - shift);
+
+            septet &= 0x7F;
+
+            if (septet == GSM7_ESCAPE)
+            {
+                escaped = true;
+                continue;
+            }
+
+            *out++ = pdu_gsm7_to_ascii(septet, escaped);
+            escaped = false;
+        }
+    }
+    else if (alphabet == PDU_ALPHABET_UCS2)
+    {
+        for (i = header; (i + 1) < octets; i += 2)
+            *out++ = (ud[i] || ud[i + 1] > 0x7F) ? '?' : ud[i + 1];
+    }
+    else
+    {
+        for (i = header; i < octets; i++)
+            *out++ = ud[i];
+    }
+
+    *out = 0;
+    return true;
+}
+
+static uint8_t pdu_alphabet(uint8_t dcs)
+{
+    /* General data coding group */
+    if ((dcs & 0xC0) == 0x00 || (dcs & 0xC0) == 0x40)
+        return (dcs >> 2) & 0x03;
+
+    /* Message class group */
+    if ((dcs & 0xF0) == 0xF0)
+        return (dcs & 0x04) ? PDU_ALPHABET_8BIT : PDU_ALPHABET_GSM7;
+
+    /* Message waiting group, UCS2 */
+    if ((dcs & 0xF0) == 0xE0)
+        return PDU_ALPHABET_UCS2;
+
+    return PDU_ALPHABET_GSM7;
+}
+
+/*
+ * The default alphabet matches ASCII for letters, digits and most punctuation.
+ * The rest are either moved, or need escape sequences which the segment
+ * lengths don't allow for, so go out as '?'.
+ */
+static uint8_t pdu_ascii_to_gsm7(char c)
+{
+    switch (c)
+    {
+        case '@':
+            return 0x00;
+        case '$':
+            return 0x02;
+        case '_':
+            return 0x11;
+        case '[': case '\\': case ']': case '^': case '`':
+        case '{': case '|': case '}': case '~':
+            return '?';
+    }
+
+    if (c < ' ' && c != '\n' && c != '\r')
+        return '?';
+
+    return c & 0x7F;
+}
+
+static char pdu_gsm7_to_ascii(uint8_t c, bool escaped)
+{
+    if (escaped)
+    {
+        switch (c)
+        {
+            case 0x14: return '^';
+            case 0x28: return '{';
+            case 0x29: return '}';
+            case 0x2F: return '\\';
+            case 0x3C: return '[';
+            case 0x3D: return '~';
+            case 0x3E: return ']';
+            case 0x40: return '|';
+        }
+
+        return '?';
+    }
+
+    switch (c)
+    {
+        case 0x00: return '@';
+        case 0x02: return '$';
+        case 0x11: return '_';
+        case '\n': return '\n';
+        case '\r': return '\r';
+        case 0x24: case 0x40: case 0x60:
+        case 0x5B: case 0x5C: case 0x5D: case 0x5E:
+        case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F:
+            return '?';
+    }
+
+    if (c < ' ')
+        return '?';
+
+    return c;
+}
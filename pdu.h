@@ -0,0 +1,33 @@
+/*
+ *   File:   pdu.h
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 14:05
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PDU_H__
+#define __PDU_H__
+
+typedef struct
+{
+    uint16_t ref;
+    uint8_t part;
+    uint8_t total;
+} pdu_concat_t;
+
+uint8_t pdu_hex_nibble(char c);
+uint8_t pdu_encode_submit(char *buffer, uint16_t size, const char *number, const char *text, uint8_t ref, uint8_t part, uint8_t total);
+bool pdu_decode_deliver(char *buffer, uint16_t len, uint16_t size, char *from, uint8_t from_size, pdu_concat_t *concat);
+
+#endif /* __PDU_H__ */
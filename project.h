@@ -21,22 +21,58 @@
 #define __PROJECT_H__
 
 #define MAX_DESC        12
-#define MAX_SENSORS     10
+/*
+ * Each sensor takes about 70 bytes of SRAM. With everything below turned on,
+ * 8 sensors leave the stack its STACK_RESERVE (see the makefile). GPRS takes
+ * around 250 bytes more, which leaves room for 4. The link fails when they
+ * don't fit. The EEPROM would hold 30 (27 with GPRS), which config.c checks
+ * at compile time.
+ */
+#ifndef MAX_SENSORS
+#define MAX_SENSORS     8
+#endif /* MAX_SENSORS */
+#define SENSOR_SET_BYTES ((MAX_SENSORS + 7) / 8)
 #define MAX_RECIPIENTS  4
 #define MAX_RECIPIENT   16
+#define MAX_TELEMETRY   (6 + (4 * 5) + ((MAX_SENSORS + 6) / 7) + (MAX_SENSORS * 3)) /* Version, seq, varints, valid bitmap, worst case deltas */
 
 #define _I2C_XFER_
 #define _I2C_XFER_MANY_
 #define _I2C_XFER_X16_
 #define _I2C_XFER_BYTE_
 #define _I2C_DS2482_SPECIAL_
+#define _I2C_ASYNC_                /* Interrupt driven, queued transfers */
+#define _I2C_BRUTEFORCE_RESET_
 
 #define _USART1_
 #define _OW_DS2482_
+#define _DS18X20_BROADCAST_CONVERT_
+#define _DS18X20_POLL_CONVERSION_  /* Not while parasite powered sensors convert */
+#define _DS2482_ASYNC_
+#define _CRC8_TABLE_                /* Or _CRC8_NIBBLE_ to save flash. Bit by bit with neither */
+//#define _CRC8_BENCHMARK_
+#define _DS18X20_BACKGROUND_SEARCH_
+#define _DS18X20_ALARM_SEARCH_
+#define DS18X20_FULL_READ_CYCLES    10 /* Alarm search: every nth cycle reads all sensors */
+#define TEMP_FILTER_MAX_DEPTH       3  /* Readings kept per sensor for the median. 2 bytes of SRAM each */
+
+/* 1-Wire buses as { DS2482 I2C address, channel }. Channel is 0-7 on a DS2482-800, DS2482_100 on a DS2482-100. Up to 16 */
+#define OW_BUSES                    { { 0x18, DS2482_100 } }
+
+//#define _GSM_PDU_MODE_
+
+/* GPRS telemetry upload. Costs GPRS_RING_SIZE plus about 100 bytes of RAM */
+//#define _GSM_GPRS_
+
+#ifdef _GSM_GPRS_
+#define MAX_APN         24
+#define MAX_URL         48
+#define GPRS_RING_SIZE  128 /* Around 5 samples with 10 sensors, more with fewer */
+#endif /* _GSM_GPRS_ */
 
 #define F_CPU      16000000
 
-#define CONFIG_MAGIC        0x454D
+#define CONFIG_MAGIC        0x4557
 
 #define CLRWDT() asm("wdr")
 
@@ -20,6 +20,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
 #include <avr/pgmspace.h>
@@ -27,6 +28,7 @@
 #include "config.h"
 #include "timeout.h"
 #include "smshistory.h"
+#include "smsbudget.h"
 #include "util.h"
 #include "sms.h"
 #include "gsm.h"
@@ -42,6 +44,8 @@
 #define SMS_STATE_CMD_AWAIT_DELETE           7
 #define SMS_STATE_CMD_START_DELETE           8
 #define SMS_STATE_CMD_DELETE                 9
+#define SMS_STATE_CMD_SEND_PART              10
+#define SMS_STATE_CMD_AWAIT_PART             13
 
 #define SMS_STATE_START_SENDALL              11
 #define SMS_STATE_SENDALL                    12
@@ -49,6 +53,8 @@
 #define MAX_UNREAD                           16
 
 #define SMS_POLL_INTERVAL                    3000
+#define SMS_COALESCE_WINDOW                  5 /* Seconds */
+#define MAX_SMS_PARTS                        8
 
 typedef struct
 {
@@ -63,12 +69,31 @@ typedef struct
     const char *from_buffer;
     const char *sendall_buffer;
     sys_config_t *config;
+    bool held_back;
+    int32_t pending_since;
+    uint8_t pending_types;
+    uint8_t pending_sensors[MESSAGE_SENSOR_TYPES][SENSOR_SET_BYTES];
+    int16_t sensor_values[MAX_SENSORS]; /* 1/16 degrees C */
+    int16_t global_values[MESSAGE_TYPES - MESSAGE_SENSOR_TYPES];
+    int8_t send_only;
+    int8_t oncall;
+    bool awaiting_ack;
+    bool escalate_armed;                /* Deadline runs from when the on-call recipient was sent it */
+    int32_t escalate_at;
+    uint8_t (*part_generator)(char *buffer, uint8_t cursor, uint8_t end);
+    uint8_t part_starts[MAX_SMS_PARTS];
+    uint8_t part;
+    uint8_t parts;
+    uint8_t part_ref;
+    bool sendall_telemetry;
+    int32_t telemetry_last;
 } sms_state_t;
 
 sms_state_t _g_sms_state;
 
 static void sms_gsm_ready(void);
 static void sms_send_buffer(sms_state_t *st);
+static void sms_send_generated(sms_state_t *st, uint8_t (*generator)(char *buffer, uint8_t cursor, uint8_t end));
 static void sms_send_message_success(void *param);
 static void sms_send_message_fail(void *param);
 static void sms_read_message_success(void *data, int16_t index, const char *from, const char *status, const char *message);
@@ -77,8 +102,23 @@ static void sms_read_messages_complete(void *data);
 static void sms_delete_message_success(void *data);
 static void sms_delete_message_fail(void *data);
 static void sms_start_read_sms_messages(void *data);
-
-extern void status_response(char *sendbuffer);
+static void sms_flush_alerts(sms_state_t *st);
+static void sms_compose_sensor_alerts(sms_state_t *st, uint8_t type);
+static bool sms_compose_single_alert(sms_state_t *st, uint8_t type, uint8_t index);
+static void sms_compose_global_alert(sms_state_t *st, uint8_t type);
+static uint8_t sms_append_sensor(char *buffer, sms_state_t *st, uint8_t type, uint8_t index, uint8_t position);
+static PGM_P sms_type_label(uint8_t type);
+static void sms_sensor_desc(sms_state_t *st, uint8_t index, char *desc);
+static void sms_clear_pending(sms_state_t *st, uint8_t type, uint8_t index);
+static uint8_t sms_append(char *buffer, PGM_P fmt, ...);
+static void sms_set_pending(sms_state_t *st, uint8_t type, uint8_t index);
+static void sms_escalate(sms_state_t *st);
+static void sms_oncall_sent(sms_state_t *st, bool sent);
+static int8_t sms_next_oncall(sms_state_t *st, uint8_t from);
+static void sms_send_telemetry(sms_state_t *st);
+
+extern uint8_t status_response(char *sendbuffer, uint8_t line, uint8_t end);
+extern void telemetry_response(char *sendbuffer);
 
 void sms_init(sys_config_t *config)
 {
@@ -89,7 +129,17 @@ void sms_init(sys_config_t *config)
     st->perform_reset = false;
     st->config = config;
     st->sendall_buffer = NULL;
-
+    st->held_back = false;
+    st->pending_types = 0;
+    memset(st->pending_sensors, 0, sizeof(st->pending_sensors));
+    st->send_only = -1;
+    st->oncall = -1;
+    st->awaiting_ack = false;
+    st->escalate_armed = false;
+    st->sendall_telemetry = false;
+    st->telemetry_last = get_tick_count();
+
+    sms_budget_init();
     gsm_init(&sms_gsm_ready);
 }
 
@@ -97,8 +147,25 @@ void sms_process(void)
 {
     sms_state_t *st = &_g_sms_state;
 
+    sms_history_expire();
+
+#ifdef _GSM_GPRS_
+    // GPRS upload may have the modem mid-operation. Wait our turn.
+    if (!gsm_ready())
+        return;
+#endif /* _GSM_GPRS_ */
+
     if (st->state == SMS_STATE_READY)
     {
+        if (!st->sendall_buffer && st->pending_types)
+            sms_flush_alerts(st);
+
+        if (!st->sendall_buffer && st->awaiting_ack)
+            sms_escalate(st);
+
+        if (!st->sendall_buffer && st->config->telemetry_interval)
+            sms_send_telemetry(st);
+
         if (st->sendall_buffer)
         {
             st->state = SMS_STATE_START_SENDALL;
@@ -161,6 +228,14 @@ void sms_process(void)
     {
         uint8_t i;
 
+        // Nothing to run. Undecodable, or part of a concatenated message.
+        if (!st->buffer[0])
+        {
+            printf("SMS: Empty message. Deleting\r\n");
+            st->state = SMS_STATE_CMD_START_DELETE;
+            return;
+        }
+
         for (i = 0; i < MAX_RECIPIENTS; i++)
         {
             if (match_phonenumber(st->config->sms_recipients[i].number, st->from_buffer))
@@ -169,7 +244,26 @@ void sms_process(void)
 
                 if (!stricmp(st->buffer, "status"))
                 {
-                    status_response(st->buffer);
+                    sms_send_generated(st, &status_response);
+                    return;
+                }
+
+                if (!stricmp(st->buffer, "telemetry"))
+                {
+                    telemetry_response(st->buffer);
+                    sms_send_buffer(st);
+                    return;
+                }
+
+                // Only means something with an escalation rota. Without one nobody
+                // would be told again, so there's nothing to acknowledge.
+                if (st->config->escalation && !stricmp(st->buffer, "ack"))
+                {
+                    printf("SMS: Alerts acknowledged by recipient %u\r\n", i);
+                    sms_history_acknowledge();
+                    st->awaiting_ack = false;
+                    st->oncall = -1;
+                    sprintf(st->buffer, "Alerts acknowledged");
                     sms_send_buffer(st);
                     return;
                 }
@@ -204,6 +298,27 @@ void sms_process(void)
         printf("SMS: Sender not permitted to run command. Deleting message\r\n", i);
         st->state = SMS_STATE_CMD_START_DELETE;
     }
+    else if (st->state == SMS_STATE_CMD_SEND_PART)
+    {
+        gsm_cb_t cb;
+        uint8_t end;
+
+        cb.success_callback = &sms_send_message_success;
+        cb.fail_callback = &sms_send_message_fail;
+        cb.data = st;
+
+        // Exactly the segment that was counted. Only the last can run on.
+        end = (st->part < st->parts) ? st->part_starts[st->part] : 0;
+
+        if (st->part_generator(st->buffer, st->part_starts[st->part - 1], end) && !end)
+            printf("SMS: Response grew while being sent. Rest dropped\r\n");
+
+        st->state = SMS_STATE_CMD_AWAIT_PART;
+
+        printf("SMS: Sending part %u of %u '%s' to '%s'\r\n", st->part, st->parts, st->buffer, st->from_buffer);
+
+        gsm_send_sms_part(st->from_buffer, st->buffer, st->part_ref, st->part, st->parts, &cb);
+    }
     else if (st->state == SMS_STATE_CMD_START_DELETE)
     {
         gsm_cb_t cb;
@@ -238,6 +353,7 @@ void sms_process(void)
             printf("SMS: No more recipients to send to\r\n");
             st->state = SMS_STATE_READY;
             st->sendall_buffer = NULL;
+            st->sendall_telemetry = false;
             return;
         }
             
@@ -255,7 +371,16 @@ void sms_process(void)
             return;
         }
 
-        if (!recipient->notify)
+        if (st->sendall_telemetry)
+        {
+            if (!recipient->telemetry)
+            {
+                st->pos_processing++;
+                st->pos++;
+                return;
+            }
+        }
+        else if (!recipient->notify)
         {
             printf("SMS: Not sending message to recipient in location %u. Not set for notify\r\n", st->pos);
             st->pos_processing++;
@@ -263,6 +388,13 @@ void sms_process(void)
             return;
         }
 
+        if (st->send_only >= 0 && st->pos != st->send_only)
+        {
+            st->pos_processing++;
+            st->pos++;
+            return;
+        }
+
         printf("SMS: Sending message '%s' to '%s'\r\n", st->sendall_buffer, recipient->number);
         gsm_send_sms(recipient->number, st->sendall_buffer, &cb);
         st->pos_processing++;
@@ -296,9 +428,23 @@ static void sms_send_message_success(void *data)
         printf("SMS: Sent SMS message to single recipient\r\n");
         st->state = SMS_STATE_CMD_START_DELETE;
     }
+    else if (st->state == SMS_STATE_CMD_AWAIT_PART)
+    {
+        if (st->part < st->parts)
+        {
+            st->part++;
+            st->state = SMS_STATE_CMD_SEND_PART;
+        }
+        else
+        {
+            printf("SMS: Sent all %u parts to single recipient\r\n", st->parts);
+            st->state = SMS_STATE_CMD_START_DELETE;
+        }
+    }
     else if (st->state == SMS_STATE_SENDALL)
     {
         printf("SMS: Sent SMS message to one of multiple recipients\r\n");
+        sms_oncall_sent(st, true);
         st->pos++;
     }
 }
@@ -312,9 +458,15 @@ static void sms_send_message_fail(void *data)
         printf("SMS: ERROR: Failed to send SMS message to single recipient\r\n");
         st->state = SMS_STATE_CMD_START_DELETE;
     }
+    else if (st->state == SMS_STATE_CMD_AWAIT_PART)
+    {
+        printf("SMS: ERROR: Failed to send part %u of %u. Abandoning the rest\r\n", st->part, st->parts);
+        st->state = SMS_STATE_CMD_START_DELETE;
+    }
     else if (st->state == SMS_STATE_SENDALL)
     {
         printf("SMS: ERROR: Failed to send SMS message to one of multiple recipients\r\n");
+        sms_oncall_sent(st, false);
         st->pos++;
     }
 }
@@ -404,7 +556,7 @@ static void sms_gsm_ready(void)
     _g_sms_state.state = SMS_STATE_READY;
 }
 
-void sms_respond_to_source(const char *fmt, ...)
+void sms_respond_to_source_P(const char *fmt, ...)
 {
     va_list args;
     sms_state_t *st = &_g_sms_state;
@@ -412,7 +564,7 @@ void sms_respond_to_source(const char *fmt, ...)
     if (st->state == SMS_STATE_CMD_EXEC)
     {
         va_start(args, fmt);
-        vsprintf(st->buffer, fmt, args);
+        vsnprintf_P(st->buffer, sizeof(st->buffer), fmt, args);
         va_end(args);
 
         sms_send_buffer(st);
@@ -438,18 +590,417 @@ static void sms_send_buffer(sms_state_t *st)
     st->state = SMS_STATE_CMD_AWAIT_DELETE;
 }
 
-void sms_try_send(uint8_t type, uint8_t index, const char *message)
+/*
+ * Sends a response which may need more than one SMS. The generator fills one
+ * segment at a time from a cursor, so no buffer larger than a segment is
+ * needed. A first pass through it records where each segment starts, for the
+ * header's count, and each part is regenerated between the same cursors.
+ */
+static void sms_send_generated(sms_state_t *st, uint8_t (*generator)(char *buffer, uint8_t cursor, uint8_t end))
+{
+    uint8_t cursor = 0;
+
+    st->parts = 0;
+
+    do
+    {
+        st->part_starts[st->parts++] = cursor;
+        cursor = generator(st->buffer, cursor, 0);
+    } while (cursor && st->parts < MAX_SMS_PARTS);
+
+    st->part_generator = generator;
+    st->part = 1;
+    st->part_ref++;
+    st->state = SMS_STATE_CMD_SEND_PART;
+}
+
+void sms_alert(uint8_t type, uint8_t index, int16_t value)
 {
     sms_state_t *st = &_g_sms_state;
 
-    if (sms_history_lodge(type, index, st->config->resend_delay))
-        st->sendall_buffer = message;
-    else
+    if (!sms_history_allowed(type, index))
+    {
         printf("SMS: Too early to send message type '%u' index '%u'\r\n", type, index);
+        return;
+    }
+
+    sms_set_pending(st, type, index);
+
+    if (type >= MESSAGE_SENSOR_TYPES)
+        st->global_values[type - MESSAGE_SENSOR_TYPES] = value;
+    else if (type != MESSAGE_TEMP_STATE)
+        st->sensor_values[index] = value;
 }
 
-bool sms_can_send_message(void)
+void sms_alert_clear(uint8_t type, uint8_t index)
 {
     sms_state_t *st = &_g_sms_state;
-    return (st->sendall_buffer == NULL);
+
+    sms_history_clear(type, index);
+
+    // Everything that was sent has cleared. No one needs chasing about it.
+    if (st->awaiting_ack && !sms_history_awaiting_ack())
+    {
+        printf("SMS: Alerts cleared. Escalation cancelled\r\n");
+        st->awaiting_ack = false;
+        st->oncall = -1;
+    }
+}
+
+static void sms_flush_alerts(sms_state_t *st)
+{
+    uint8_t type;
+
+    if ((get_tick_count() - st->pending_since) < (SMS_COALESCE_WINDOW * TIMEOUT_TICK_PER_SECOND))
+        return;
+
+    if (!sms_budget_available(st->config->sms_per_hour, st->config->sms_per_day))
+    {
+        if (!st->held_back)
+            printf("SMS: Alert limit reached. Holding back alerts\r\n");
+
+        st->held_back = true;
+        return;
+    }
+
+    // Composed in the command buffer, which is free whenever we're idle
+    st->buffer[0] = 0;
+
+    if (st->held_back)
+        sms_append(st->buffer, PSTR("Alert limit reached. Some alerts were delayed."));
+
+    // Alerts which don't fit stay pending for the next message
+    for (type = 0; type < MESSAGE_TYPES; type++)
+    {
+        if (!(st->pending_types & (1 << type)))
+            continue;
+
+        if (type < MESSAGE_SENSOR_TYPES)
+            sms_compose_sensor_alerts(st, type);
+        else
+            sms_compose_global_alert(st, type);
+    }
+
+    if (!st->buffer[0])
+        return;
+
+    st->held_back = false;
+
+    sms_budget_take(st->config->sms_per_hour, st->config->sms_per_day);
+    st->sendall_buffer = st->buffer;
+    st->send_only = -1;
+
+    if (!st->config->escalation)
+        return;
+
+    // Escalation rota. Goes to whoever is on call, starting with the first
+    // recipient. An escalation already under way keeps its deadline.
+    if (st->oncall < 0)
+        st->oncall = sms_next_oncall(st, 0);
+
+    st->send_only = st->oncall;
+
+    if (!st->awaiting_ack)
+    {
+        st->awaiting_ack = true;
+        st->escalate_armed = false;
+    }
+}
+
+static void sms_set_pending(sms_state_t *st, uint8_t type, uint8_t index)
+{
+    // First alert of a new batch. Starts the coalescing window.
+    if (!st->pending_types)
+        st->pending_since = get_tick_count();
+
+    st->pending_types |= (1 << type);
+
+    if (type < MESSAGE_SENSOR_TYPES)
+        bitset_set(st->pending_sensors[type], index);
+}
+
+/*
+ * Nobody has replied 'ack' in time. Whatever they were sent and is still
+ * unacknowledged goes to the next recipient on the rota. It's rebuilt from the
+ * history, as the buffer it went out in has been reused since. Once the rota
+ * runs out the next alert starts again from the top.
+ */
+static void sms_escalate(sms_state_t *st)
+{
+    int8_t next;
+    uint8_t type;
+    uint8_t i;
+
+    if (!st->config->escalation)
+    {
+        st->awaiting_ack = false;
+        return;
+    }
+
+    if (!st->escalate_armed || (int32_t)(get_tick_count() - st->escalate_at) < 0)
+        return;
+
+    next = sms_next_oncall(st, st->oncall + 1);
+
+    if (next < 0)
+    {
+        printf("SMS: No acknowledgement and no more recipients to escalate to\r\n");
+        st->awaiting_ack = false;
+        st->oncall = -1;
+        return;
+    }
+
+    printf("SMS: No acknowledgement. Escalating to recipient %u\r\n", next);
+
+    st->oncall = next;
+    st->escalate_armed = false;
+
+    // Sent like any other alert, so it's coalesced and counts towards the limit
+    for (type = 0; type < MESSAGE_TYPES; type++)
+    {
+        for (i = 0; i < ((type < MESSAGE_SENSOR_TYPES) ? MAX_SENSORS : 1); i++)
+        {
+            if (sms_history_unacknowledged(type, i))
+                sms_set_pending(st, type, i);
+        }
+    }
+}
+
+/*
+ * Alert delivery to the on-call recipient starts their time to 'ack'. If it
+ * couldn't be sent there's no point waiting, the next one is tried straight away.
+ */
+static void sms_oncall_sent(sms_state_t *st, bool sent)
+{
+    if (!st->awaiting_ack || st->escalate_armed || st->sendall_telemetry || st->pos != st->send_only)
+        return;
+
+    st->escalate_armed = true;
+    st->escalate_at = get_tick_count();
+
+    if (sent)
+        st->escalate_at += ((int32_t)st->config->escalation * 60 * TIMEOUT_TICK_PER_SECOND);
+}
+
+/*
+ * Periodic report to telemetry recipients. Composed in the command buffer,
+ * which is free whenever we're idle. Doesn't count towards the alert limit.
+ */
+static void sms_send_telemetry(sms_state_t *st)
+{
+    if ((get_tick_count() - st->telemetry_last) < ((int32_t)st->config->telemetry_interval * 60 * TIMEOUT_TICK_PER_SECOND))
+        return;
+
+    st->telemetry_last = get_tick_count();
+
+    telemetry_response(st->buffer);
+
+    printf("SMS: Sending periodic telemetry\r\n");
+
+    st->sendall_telemetry = true;
+    st->send_only = -1;
+    st->sendall_buffer = st->buffer;
+}
+
+static int8_t sms_next_oncall(sms_state_t *st, uint8_t from)
+{
+    uint8_t i;
+
+    for (i = from; i < MAX_RECIPIENTS; i++)
+    {
+        if (*st->config->sms_recipients[i].number && st->config->sms_recipients[i].notify)
+            return i;
+    }
+
+    return -1;
+}
+
+static void sms_compose_sensor_alerts(sms_state_t *st, uint8_t type)
+{
+    char *buffer = st->buffer;
+    uint8_t count = 0;
+    uint8_t fit = 0;
+    uint8_t len;
+    uint8_t i;
+
+    for (i = 0; i < MAX_SENSORS; i++)
+    {
+        if (bitset_test(st->pending_sensors[type], i))
+            count++;
+    }
+
+    // A lone alert gets the long form, with the threshold where there is one
+    if (count == 1)
+    {
+        for (i = 0; !bitset_test(st->pending_sensors[type], i); i++)
+            ;
+
+        if (sms_compose_single_alert(st, type, i))
+            sms_clear_pending(st, type, i);
+
+        return;
+    }
+
+    // Work out how many will fit, so that the count in the heading is right
+    len = strlen(buffer) + sms_append(NULL, PSTR("\n%u sensors %S: "), count, sms_type_label(type));
+
+    for (i = 0; i < MAX_SENSORS; i++)
+    {
+        if (!bitset_test(st->pending_sensors[type], i))
+            continue;
+
+        len += sms_append_sensor(NULL, st, type, i, fit);
+
+        if (len > MAX_SMS)
+            break;
+
+        fit++;
+    }
+
+    if (!fit)
+        return;
+
+    sms_append(buffer, (fit > 1) ? PSTR("\n%u sensors %S: ") : PSTR("\n%u sensor %S: "), fit, sms_type_label(type));
+
+    for (i = 0, count = 0; i < MAX_SENSORS && count < fit; i++)
+    {
+        if (!bitset_test(st->pending_sensors[type], i))
+            continue;
+
+        sms_append_sensor(buffer, st, type, i, count++);
+        sms_clear_pending(st, type, i);
+    }
+}
+
+static bool sms_compose_single_alert(sms_state_t *st, uint8_t type, uint8_t index)
+{
+    tempsensor_config_t *sensor = &st->config->temp_sensors[index];
+    char desc[MAX_DESC + 8];
+    char current[MAX_FDP];
+    char threshold[MAX_FDP];
+
+    sms_sensor_desc(st, index, desc);
+    format_temp(current, st->sensor_values[index]);
+
+    if (type == MESSAGE_TEMP_RANGE_HIGH)
+    {
+        format_i16_1dp(threshold, sensor->high_threshold);
+        return sms_append(st->buffer, PSTR("\nSensor '%s' is above threshold: current: %s threshold: %s"),
+            desc, current, threshold);
+    }
+
+    if (type == MESSAGE_TEMP_RANGE_LOW)
+    {
+        format_i16_1dp(threshold, sensor->low_threshold);
+        return sms_append(st->buffer, PSTR("\nSensor '%s' is below threshold: current: %s threshold: %s"),
+            desc, current, threshold);
+    }
+
+    return sms_append(st->buffer, PSTR("\nLost connectivity to temperature sensor '%s'"), desc);
+}
+
+static void sms_compose_global_alert(sms_state_t *st, uint8_t type)
+{
+    int16_t value = st->global_values[type - MESSAGE_SENSOR_TYPES];
+    bool fitted = false;
+
+    switch (type)
+    {
+        case MESSAGE_STARTUP:
+            fitted = sms_append(st->buffer, PSTR("\nTemperature sensor failure. There should be %u sensors, but %u were found"),
+                st->config->expected_sensors, value);
+            break;
+        case MESSAGE_MAINS_STATE_OFF:
+            fitted = sms_append(st->buffer, PSTR("\nMains power has failed"));
+            break;
+        case MESSAGE_MAINS_STATE_ON:
+            fitted = sms_append(st->buffer, PSTR("\nMains power restored"));
+            break;
+        case MESSAGE_LOW_BATTERY:
+            fitted = sms_append(st->buffer, PSTR("\nLow battery alert"));
+            break;
+    }
+
+    if (fitted)
+    {
+        st->pending_types &= ~(1 << type);
+        sms_history_sent(type, 0, st->config->resend_delay);
+    }
+}
+
+static uint8_t sms_append_sensor(char *buffer, sms_state_t *st, uint8_t type, uint8_t index, uint8_t position)
+{
+    char desc[MAX_DESC + 8];
+    char value[MAX_FDP];
+
+    sms_sensor_desc(st, index, desc);
+
+    if (type == MESSAGE_TEMP_STATE)
+        return sms_append(buffer, position ? PSTR(", %s") : PSTR("%s"), desc);
+
+    format_temp(value, st->sensor_values[index]);
+    return sms_append(buffer, position ? PSTR(", %s %s") : PSTR("%s %s"), desc, value);
+}
+
+static PGM_P sms_type_label(uint8_t type)
+{
+    if (type == MESSAGE_TEMP_RANGE_HIGH)
+        return PSTR("high");
+    if (type == MESSAGE_TEMP_RANGE_LOW)
+        return PSTR("low");
+    return PSTR("lost");
+}
+
+static void sms_sensor_desc(sms_state_t *st, uint8_t index, char *desc)
+{
+    if (*st->config->temp_sensors[index].name)
+        strcpy(desc, st->config->temp_sensors[index].name);
+    else
+        sprintf(desc, "Temp%u", index + 1);
+}
+
+static void sms_clear_pending(sms_state_t *st, uint8_t type, uint8_t index)
+{
+    bitset_clr(st->pending_sensors[type], index);
+    sms_history_sent(type, index, st->config->resend_delay);
+
+    if (bitset_empty(st->pending_sensors[type], SENSOR_SET_BYTES))
+        st->pending_types &= ~(1 << type);
+}
+
+/*
+ * Appends to an alert message. The first line has its leading newline dropped.
+ * Returns the length appended, or 0 if it didn't fit (buffer left unchanged).
+ * With a NULL buffer, just returns the length it would have appended.
+ */
+static uint8_t sms_append(char *buffer, PGM_P fmt, ...)
+{
+    va_list args;
+    uint8_t len = 0;
+    int16_t added;
+
+    if (buffer)
+    {
+        len = strlen(buffer);
+        if (!len && pgm_read_byte(fmt) == '\n')
+            fmt++;
+    }
+
+    va_start(args, fmt);
+    if (buffer)
+        added = vsnprintf_P(buffer + len, (MAX_SMS + 1) - len, fmt, args);
+    else
+        added = vsnprintf_P(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (added < 0)
+        added = 0;
+
+    if (buffer && (len + added) > MAX_SMS)
+    {
+        buffer[len] = 0;
+        return 0;
+    }
+
+    return (uint8_t)added;
 }
@@ -21,8 +21,11 @@
 
 void sms_init(sys_config_t *config);
 void sms_process(void);
-void sms_respond_to_source(const char *fmt, ...);
-void sms_try_send(uint8_t type, uint8_t index, const char *message);
-bool sms_can_send_message(void);
+void sms_respond_to_source_P(const char *fmt, ...);
+void sms_alert(uint8_t type, uint8_t index, int16_t value);
+void sms_alert_clear(uint8_t type, uint8_t index);
+
+/* Format strings are kept in flash, like printf() in util.h */
+#define sms_respond_to_source(fmt, ...) sms_respond_to_source_P(PSTR(fmt) __VA_OPT__(,) __VA_ARGS__)
 
 #endif /* __SMS_H__ */
@@ -0,0 +1,115 @@
+/*
+ *   File:   smsbudget.c
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 10:12
+ *
+ *   Global limit on the number of alerts sent, regardless of type. Implemented
+ *   as two token buckets (per hour and per day) which refill continuously.
+ *
+ *   A bucket level is kept in 'token-seconds', i.e. one token is worth the
+ *   number of seconds in the bucket period, and every second adds one unit per
+ *   token allowed in that period. This keeps the refill in integer arithmetic.
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "project.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "smsbudget.h"
+#include "timeout.h"
+
+#define SECONDS_PER_HOUR    3600UL
+#define SECONDS_PER_DAY     86400UL
+
+typedef struct
+{
+    uint32_t hour_level;
+    uint32_t day_level;
+    uint32_t last_refill;
+} sms_budget_t;
+
+sms_budget_t _g_budget;
+
+static void sms_budget_refill(uint8_t per_hour, uint8_t per_day);
+static uint32_t sms_budget_fill(uint32_t level, uint32_t seconds, uint8_t rate, uint32_t period);
+
+void sms_budget_init(void)
+{
+    // Start full. The levels are clamped to capacity on the first refill.
+    _g_budget.hour_level = UINT32_MAX;
+    _g_budget.day_level = UINT32_MAX;
+    _g_budget.last_refill = (uint32_t)get_tick_count();
+}
+
+bool sms_budget_available(uint8_t per_hour, uint8_t per_day)
+{
+    sms_budget_refill(per_hour, per_day);
+
+    if (per_hour && _g_budget.hour_level < SECONDS_PER_HOUR)
+        return false;
+
+    if (per_day && _g_budget.day_level < SECONDS_PER_DAY)
+        return false;
+
+    return true;
+}
+
+void sms_budget_take(uint8_t per_hour, uint8_t per_day)
+{
+    sms_budget_refill(per_hour, per_day);
+
+    if (per_hour && _g_budget.hour_level >= SECONDS_PER_HOUR)
+        _g_budget.hour_level -= SECONDS_PER_HOUR;
+
+    if (per_day && _g_budget.day_level >= SECONDS_PER_DAY)
+        _g_budget.day_level -= SECONDS_PER_DAY;
+}
+
+static void sms_budget_refill(uint8_t per_hour, uint8_t per_day)
+{
+    uint32_t now = (uint32_t)get_tick_count();
+    uint32_t seconds = (now - _g_budget.last_refill) / TIMEOUT_TICK_PER_SECOND;
+
+    // Carry the part second over to the next refill
+    _g_budget.last_refill += seconds * TIMEOUT_TICK_PER_SECOND;
+
+    // Both buckets are full after a day. Stops the multiply below overflowing.
+    if (seconds > SECONDS_PER_DAY)
+        seconds = SECONDS_PER_DAY;
+
+    _g_budget.hour_level = sms_budget_fill(_g_budget.hour_level, seconds, per_hour, SECONDS_PER_HOUR);
+    _g_budget.day_level = sms_budget_fill(_g_budget.day_level, seconds, per_day, SECONDS_PER_DAY);
+}
+
+static uint32_t sms_budget_fill(uint32_t level, uint32_t seconds, uint8_t rate, uint32_t period)
+{
+    uint32_t capacity = (uint32_t)rate * period;
+
+    // No limit. Leave the level alone so the bucket is full if one gets set.
+    if (!rate)
+        return level;
+
+    if (level >= capacity)
+        return capacity;
+
+    level += seconds * rate;
+
+    if (level > capacity)
+        level = capacity;
+
+    return level;
+}
@@ -0,0 +1,26 @@
+/*
+ *   File:   smsbudget.h
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 10:12
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SMSBUDGET_H__
+#define __SMSBUDGET_H__
+
+void sms_budget_init(void);
+bool sms_budget_available(uint8_t per_hour, uint8_t per_day);
+void sms_budget_take(uint8_t per_hour, uint8_t per_day);
+
+#endif /* __SMSBUDGET_H__ */
@@ -6,6 +6,13 @@
  * 
  *   Keeps a history of message types sent, so that recipients don't get spammed
  *   by the same message type over and over.
+ *
+ *   Every (message type, sensor index) pair has its own slot in a directly
+ *   indexed table holding the tick at which it may next be sent. Slots are
+ *   never shared, so an entry can't be evicted before its hold-off expires.
+ *
+ *   Alerts which have been sent are awaiting acknowledgement. An 'ack' from a
+ *   recipient suppresses all of those until their condition clears.
  * 
  *   This is free software: you can redistribute it and/or modify
  *   it under the terms of the GNU General Public License as published by
@@ -28,53 +35,113 @@
 
 #include "smshistory.h"
 #include "timeout.h"
+#include "util.h"
 
-#define MAX_SMS_HISTORY    8
+/* Per-sensor message types get MAX_SENSORS slots each, the rest get one */
+#define MAX_SMS_HISTORY    ((MESSAGE_SENSOR_TYPES * MAX_SENSORS) + (MESSAGE_TYPES - MESSAGE_SENSOR_TYPES))
 
-typedef struct
-{
-    uint8_t type;
-    uint8_t index;
-    int32_t next_allowed_timestamp;
-} history_entry_t;
+#define HISTORY_FLAG_BYTES BITSET_BYTES(MAX_SMS_HISTORY)
+
+/*
+ * Hold-offs end at a time in units of 512 ticks (5.12 seconds). 16 bits of
+ * those wrap every 93 hours, which is over twice the longest hold-off, so a
+ * hold-off compares correctly until long after it has ended.
+ * sms_history_expire() forgets ended ones well before then.
+ */
+#define HISTORY_UNIT_SHIFT 9
 
-uint8_t _g_history_idx;
+uint16_t _g_next_allowed[MAX_SMS_HISTORY];
+uint8_t _g_holding_off[HISTORY_FLAG_BYTES];
+uint8_t _g_awaiting_ack[HISTORY_FLAG_BYTES];
+uint8_t _g_acknowledged[HISTORY_FLAG_BYTES];
+uint8_t _g_expire_slot;
 
-history_entry_t _g_history[MAX_SMS_HISTORY];
+static uint8_t sms_history_slot(uint8_t type, uint8_t index);
+static bool sms_history_holding_off(uint8_t slot);
 
 void sms_history_init(void)
 {
-    _g_history_idx = 0;
-    memset(_g_history, 0, sizeof(_g_history));
+    memset(_g_holding_off, 0, sizeof(_g_holding_off));
+    memset(_g_awaiting_ack, 0, sizeof(_g_awaiting_ack));
+    memset(_g_acknowledged, 0, sizeof(_g_acknowledged));
+    _g_expire_slot = 0;
 }
 
-bool sms_history_lodge(uint8_t type, uint8_t index, uint16_t seconds_till_next)
+/* Whether a message may be sent. The hold-off only starts once it has been */
+bool sms_history_allowed(uint8_t type, uint8_t index)
 {
-    uint8_t i;
+    uint8_t slot = sms_history_slot(type, index);
 
-    for (i = 0; i < MAX_SMS_HISTORY; i++)
+    // Someone has already acknowledged this one. Quiet until it clears.
+    if (bitset_test(_g_acknowledged, slot))
+        return false;
+
+    // Not ready for another message like this yet. Discard.
+    if (sms_history_holding_off(slot))
     {
-        //printf("S: %u %lu %u %u\r\n", i, _g_history[i].next_allowed_timestamp, _g_history[i].type, _g_history[i].index);
-        if (_g_history[i].type == type && _g_history[i].index == index)
-        {
-            // Not ready for another message like this yet. Discard.
-            if (_g_history[i].next_allowed_timestamp > get_tick_count())
-            {
-                //printf("Rejecting message type: %u index: %u next_allowed_timestamp: %lu get_tick_count(): %lu\r\n", type, index,
-                    //_g_history[i].next_allowed_timestamp, get_tick_count());
-                return false;
-            }
-        }
+        //printf("Rejecting message type: %u index: %u\r\n", type, index);
+        return false;
     }
 
-    _g_history[_g_history_idx].type = type;
-    _g_history[_g_history_idx].index = index;
-    _g_history[_g_history_idx].next_allowed_timestamp = (get_tick_count() + (seconds_till_next * TIMEOUT_TICK_PER_SECOND));
+    return true;
+}
 
-    _g_history_idx++;
+void sms_history_sent(uint8_t type, uint8_t index, uint16_t seconds_till_next)
+{
+    uint8_t slot = sms_history_slot(type, index);
+    uint32_t holdoff = ((uint32_t)seconds_till_next * TIMEOUT_TICK_PER_SECOND) + (1UL << HISTORY_UNIT_SHIFT) - 1;
 
-    if (_g_history_idx >= MAX_SMS_HISTORY)
-        _g_history_idx = 0;
+    _g_next_allowed[slot] = (uint16_t)(((uint32_t)get_tick_count() >> HISTORY_UNIT_SHIFT) + (holdoff >> HISTORY_UNIT_SHIFT));
+    bitset_set(_g_holding_off, slot);
+    bitset_set(_g_awaiting_ack, slot);
+}
 
-    return true;
+/* Called from the main loop. Checks one slot per call, so all are seen within moments */
+void sms_history_expire(void)
+{
+    if (!sms_history_holding_off(_g_expire_slot))
+        bitset_clr(_g_holding_off, _g_expire_slot);
+
+    if (++_g_expire_slot == MAX_SMS_HISTORY)
+        _g_expire_slot = 0;
+}
+
+void sms_history_acknowledge(void)
+{
+    bitset_or(_g_acknowledged, _g_awaiting_ack, HISTORY_FLAG_BYTES);
+    memset(_g_awaiting_ack, 0, HISTORY_FLAG_BYTES);
+}
+
+bool sms_history_awaiting_ack(void)
+{
+    return !bitset_empty(_g_awaiting_ack, HISTORY_FLAG_BYTES);
+}
+
+/* Sent, not yet acknowledged and not cleared */
+bool sms_history_unacknowledged(uint8_t type, uint8_t index)
+{
+    return bitset_test(_g_awaiting_ack, sms_history_slot(type, index));
+}
+
+void sms_history_clear(uint8_t type, uint8_t index)
+{
+    uint8_t slot = sms_history_slot(type, index);
+
+    bitset_clr(_g_awaiting_ack, slot);
+    bitset_clr(_g_acknowledged, slot);
+}
+
+static uint8_t sms_history_slot(uint8_t type, uint8_t index)
+{
+    if (type < MESSAGE_SENSOR_TYPES)
+        return (type * MAX_SENSORS) + index;
+
+    return (MESSAGE_SENSOR_TYPES * MAX_SENSORS) + (type - MESSAGE_SENSOR_TYPES);
+}
+
+static bool sms_history_holding_off(uint8_t slot)
+{
+    uint16_t now = (uint16_t)((uint32_t)get_tick_count() >> HISTORY_UNIT_SHIFT);
+
+    return bitset_test(_g_holding_off, slot) && (int16_t)(_g_next_allowed[slot] - now) > 0;
 }
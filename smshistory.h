@@ -19,15 +19,28 @@
 #ifndef __SMSHISTORY_H__
 #define __SMSHISTORY_H__
 
-#define MESSAGE_STARTUP           1
-#define MESSAGE_TEMP_RANGE_LOW    2
-#define MESSAGE_TEMP_RANGE_HIGH   3
-#define MESSAGE_TEMP_STATE        4
-#define MESSAGE_MAINS_STATE_OFF   5
-#define MESSAGE_MAINS_STATE_ON    6
-#define MESSAGE_LOW_BATTERY       7
+/* Per-sensor message types. These must come first */
+#define MESSAGE_TEMP_RANGE_LOW    0
+#define MESSAGE_TEMP_RANGE_HIGH   1
+#define MESSAGE_TEMP_STATE        2
+
+#define MESSAGE_SENSOR_TYPES      3
+
+/* Global message types. Index is always 0 */
+#define MESSAGE_STARTUP           3
+#define MESSAGE_MAINS_STATE_OFF   4
+#define MESSAGE_MAINS_STATE_ON    5
+#define MESSAGE_LOW_BATTERY       6
+
+#define MESSAGE_TYPES             7
 
 void sms_history_init(void);
-bool sms_history_lodge(uint8_t type, uint8_t index, uint16_t seconds_till_next);
+bool sms_history_allowed(uint8_t type, uint8_t index);
+void sms_history_sent(uint8_t type, uint8_t index, uint16_t seconds_till_next);
+void sms_history_expire(void);
+void sms_history_acknowledge(void);
+bool sms_history_awaiting_ack(void);
+bool sms_history_unacknowledged(uint8_t type, uint8_t index);
+void sms_history_clear(uint8_t type, uint8_t index);
 
 #endif /* __SMSHISTORY_H__ */
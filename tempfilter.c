@@ -0,0 +1,119 @@
+/*
+ *   File:   tempfilter.c
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 20:15
+ *
+ *   Smooths the readings of each sensor before they're compared against its
+ *   thresholds, so one bad reading can't raise an alert. A reading which
+ *   passes its CRC can still be wrong: the 85.0C power-on value, or a spike
+ *   from a marginal bus.
+ *
+ *   Each sensor keeps its last few readings. The median of the newest 'depth'
+ *   of them throws out a lone spike, which an average would only dilute, and
+ *   an exponential moving average of the medians takes out the jitter. A
+ *   depth of 1 passes readings straight through.
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "project.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tempfilter.h"
+#include "util.h"
+
+#define TEMP_FILTER_EMA_SHIFT   1   /* Each median moves the average half way to it */
+#define TEMP_FILTER_EMA_FRAC    4   /* Extra fraction bits kept in the average */
+
+typedef struct
+{
+    int16_t samples[TEMP_FILTER_MAX_DEPTH];
+    int16_t ema;                    /* 1/16 degrees C << TEMP_FILTER_EMA_FRAC */
+    uint8_t count;                  /* Up to TEMP_FILTER_MAX_DEPTH */
+    uint8_t next;
+} temp_filter_t;
+
+temp_filter_t _g_temp_filters[MAX_SENSORS];
+
+static int16_t temp_filter_median(temp_filter_t *f, uint8_t n);
+
+void temp_filter_reset(uint8_t index)
+{
+    _g_temp_filters[index].count = 0;
+    _g_temp_filters[index].next = 0;
+}
+
+/* Adds a reading in 1/16 degrees C. Returns the filtered temperature in the same units */
+int16_t temp_filter_add(uint8_t index, int16_t temp, uint8_t depth)
+{
+    temp_filter_t *f = &_g_temp_filters[index];
+    int32_t target;
+
+    depth = min_(max_(depth, 1), TEMP_FILTER_MAX_DEPTH);
+
+    f->samples[f->next] = temp;
+    f->next = (f->next + 1) % TEMP_FILTER_MAX_DEPTH;
+
+    if (f->count < TEMP_FILTER_MAX_DEPTH)
+        f->count++;
+
+    target = (int32_t)temp_filter_median(f, min_(f->count, depth)) << TEMP_FILTER_EMA_FRAC;
+
+    // Nothing to average against yet, or averaging is off. Follow the median.
+    if (f->count == 1 || depth == 1)
+        f->ema = target;
+    else
+        f->ema += (target - f->ema) >> TEMP_FILTER_EMA_SHIFT;
+
+    return (f->ema + (1 << (TEMP_FILTER_EMA_FRAC - 1))) >> TEMP_FILTER_EMA_FRAC;
+}
+
+/*
+ * Until a sensor has a full window the median can't reject anything, so a
+ * bad first reading would go straight through. Its thresholds wait till then.
+ */
+bool temp_filter_settled(uint8_t index, uint8_t depth)
+{
+    return _g_temp_filters[index].count >= min_(depth, TEMP_FILTER_MAX_DEPTH);
+}
+
+/* Median of the newest n samples. The middle two are averaged when n is even. */
+static int16_t temp_filter_median(temp_filter_t *f, uint8_t n)
+{
+    int16_t sorted[TEMP_FILTER_MAX_DEPTH];
+    uint8_t pos = f->next;
+    uint8_t i;
+    uint8_t j;
+
+    // Insertion sort. It's only a handful of samples.
+    for (i = 0; i < n; i++)
+    {
+        int16_t sample;
+
+        pos = (pos + TEMP_FILTER_MAX_DEPTH - 1) % TEMP_FILTER_MAX_DEPTH;
+        sample = f->samples[pos];
+
+        for (j = i; j > 0 && sorted[j - 1] > sample; j--)
+            sorted[j] = sorted[j - 1];
+
+        sorted[j] = sample;
+    }
+
+    if (n & 1)
+        return sorted[n / 2];
+
+    return (sorted[(n / 2) - 1] + sorted[n / 2]) / 2;
+}
@@ -0,0 +1,26 @@
+/*
+ *   File:   tempfilter.h
+ *   Author: Matt
+ *
+ *   Created on 18 October 2026, 20:15
+ *
+ *   This is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *   This software is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *   You should have received a copy of the GNU General Public License
+ *   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TEMPFILTER_H__
+#define __TEMPFILTER_H__
+
+void temp_filter_reset(uint8_t index);
+int16_t temp_filter_add(uint8_t index, int16_t temp, uint8_t depth);
+bool temp_filter_settled(uint8_t index, uint8_t depth);
+
+#endif /* __TEMPFILTER_H__ */
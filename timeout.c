@@ -137,6 +137,12 @@ void timeout_stop(int8_t index)
     timer->flags &= ~F_RUNNING;
 }
 
+/* Takes effect from the next start */
+void timeout_set_interval(int8_t index, uint32_t interval)
+{
+    _g_timers[index].interval = interval;
+}
+
 int32_t get_tick_count(void)
 {
     return _g_tick_count;
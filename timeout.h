@@ -25,6 +25,7 @@ int8_t timeout_create(uint32_t interval, bool start, bool reapeat, void (*callba
 void timeout_destroy(int8_t index);
 void timeout_start(int8_t index);
 void timeout_stop(int8_t index);
+void timeout_set_interval(int8_t index, uint32_t interval);
 int32_t get_tick_count(void);
 
 #endif /* __TIMEOUT_H__ */
\ No newline at end of file
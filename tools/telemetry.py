@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+#
+#   File:   telemetry.py
+#   Author: Matt
+#
+#   Decodes the "T:" telemetry SMS produced by telemetry_response() in main.c
+#
+#   Usage: telemetry.py "T:AQAB..."   (or one message per line on stdin)
+#
+#   This is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#   This software is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#   You should have received a copy of the GNU General Public License
+#   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import base64
+import json
+import sys
+
+TELEMETRY_VERSION = 1
+
+
+def read_varint(data, pos):
+    value = 0
+    shift = 0
+
+    while True:
+        if pos >= len(data):
+            raise ValueError("truncated varint")
+
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+
+        if not byte & 0x80:
+            return value, pos
+
+
+def zigzag_decode(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode(message):
+    message = message.strip()
+
+    if not message.startswith("T:"):
+        raise ValueError("not a telemetry message")
+
+    data = base64.b64decode(message[2:])
+
+    if data[0] != TELEMETRY_VERSION:
+        raise ValueError("unsupported version %u" % data[0])
+
+    pos = 1
+    seq, pos = read_varint(data, pos)
+    uptime, pos = read_varint(data, pos)
+    mains, pos = read_varint(data, pos)
+    battery, pos = read_varint(data, pos)
+    count, pos = read_varint(data, pos)
+    valid, pos = read_varint(data, pos)
+
+    sensors = []
+    previous = 0
+
+    for i in range(count):
+        if not valid & (1 << i):
+            sensors.append(None)
+            continue
+
+        delta, pos = read_varint(data, pos)
+        previous += zigzag_decode(delta)
+        sensors.append(previous / 10.0)
+
+    return {
+        "sequence": seq,
+        "uptime": uptime,
+        "mains_frequency": mains,
+        "battery_voltage": battery / 100.0,
+        "temperatures": sensors,
+    }
+
+
+def main():
+    messages = sys.argv[1:] or sys.stdin
+
+    for message in messages:
+        if message.strip():
+            print(json.dumps(decode(message)))
+
+
+if __name__ == "__main__":
+    main()
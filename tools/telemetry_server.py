@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+#
+#   File:   telemetry_server.py
+#   Author: Matt
+#
+#   Stand-in for the GPRS telemetry endpoint. Accepts the batched POSTs made
+#   by gprs.c, decodes each "T:" line and prints it as JSON.
+#
+#   Usage: telemetry_server.py [port]   (then set 'url http://<host>:<port>/')
+#
+#   Set FAIL_EVERY=n in the environment to answer every nth request with a
+#   503, to exercise the retry and backoff.
+#
+#   This is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#   This software is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#   You should have received a copy of the GNU General Public License
+#   along with this software.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import json
+import os
+import sys
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+from telemetry import decode
+
+FAIL_EVERY = int(os.environ.get("FAIL_EVERY", "0"))
+
+
+class TelemetryHandler(BaseHTTPRequestHandler):
+    requests = 0
+
+    def do_POST(self):
+        TelemetryHandler.requests += 1
+
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length).decode("ascii", "replace")
+
+        if FAIL_EVERY and TelemetryHandler.requests % FAIL_EVERY == 0:
+            print("Request %u: failing on purpose" % TelemetryHandler.requests)
+            self.send_response(503)
+            self.end_headers()
+            return
+
+        lines = [line for line in body.splitlines() if line.strip()]
+        print("Request %u: %u samples" % (TelemetryHandler.requests, len(lines)))
+
+        for line in lines:
+            try:
+                print(json.dumps(decode(line)))
+            except ValueError as e:
+                print("Bad sample '%s': %s" % (line, e))
+
+        self.send_response(200)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8080
+    HTTPServer(("", port), TelemetryHandler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -78,6 +78,32 @@ void format_fixedpoint(char *buf, int16_t value, uint8_t type)
         sprintf(buf, "%s%u.%02u", sign, abs(value) / _2DP_BASE, abs(value) % _2DP_BASE);
 }
 
+/* Both round half away from zero */
+int16_t temp_from_decicelsius(int16_t decicelsius)
+{
+    int32_t temp = (int32_t)decicelsius * TEMP_ONE;
+
+    return (temp >= 0) ? ((temp + (_1DP_BASE / 2)) / _1DP_BASE) : -((-temp + (_1DP_BASE / 2)) / _1DP_BASE);
+}
+
+int16_t temp_to_decicelsius(int16_t temp)
+{
+    int32_t decicelsius = (int32_t)temp * _1DP_BASE;
+
+    return (decicelsius >= 0) ? ((decicelsius + (TEMP_ONE / 2)) / TEMP_ONE) : -((-decicelsius + (TEMP_ONE / 2)) / TEMP_ONE);
+}
+
+void format_hex(char *buf, const uint8_t *data, uint8_t len)
+{
+    while (len--)
+    {
+        sprintf(buf, "%02X", *data++);
+        buf += 2;
+    }
+
+    *buf = 0;
+}
+
 char *csvfield(char *s, char **saveptr)
 {
     char *end;
@@ -185,14 +211,120 @@ bool match_phonenumber(const char *n1, const char *n2)
     return strcmp(n1, n) == 0;
 }
 
-void eeprom_write_data(uint8_t addr, uint8_t *bytes, uint8_t len)
+void eeprom_write_data(uint16_t addr, uint8_t *bytes, uint16_t len)
+{
+    eeprom_update_block(bytes, (void *)addr, len);
+}
+
+void eeprom_read_data(uint16_t addr, uint8_t *bytes, uint16_t len)
+{
+    eeprom_read_block(bytes, (void *)addr, len);
+}
+
+/*
+ * LEB128 style. 7 bits per byte, least significant first, top bit set on all
+ * but the last. Returns the number of bytes written.
+ */
+uint8_t varint_encode(uint8_t *dest, uint32_t value)
+{
+    uint8_t len = 0;
+
+    while (value > 0x7F)
+    {
+        dest[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    dest[len++] = value;
+    return len;
+}
+
+/*
+ * A bit set as a single varint, bit 0 first, so it decodes as one integer of
+ * however many bits. Trailing zeros aren't sent.
+ */
+uint8_t varint_encode_bits(uint8_t *dest, const uint8_t *set, uint8_t bits)
+{
+    uint8_t len = 0;
+    uint8_t pos = 0;
+    uint8_t group;
+    uint8_t i;
+
+    while (bits && !bitset_test(set, bits - 1))
+        bits--;
+
+    do
+    {
+        group = 0;
+
+        for (i = 0; i < 7 && pos < bits; i++, pos++)
+        {
+            if (bitset_test(set, pos))
+                group |= (1 << i);
+        }
+
+        dest[len++] = group | ((pos < bits) ? 0x80 : 0);
+    } while (pos < bits);
+
+    return len;
+}
+
+/* Maps small negative numbers to small positive ones so they varint well */
+uint32_t zigzag_encode(int32_t value)
 {
-    uint16_t dest = addr;
-    eeprom_update_block(bytes, (void *)dest, len);
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
 }
 
-void eeprom_read_data(uint8_t addr, uint8_t *bytes, uint8_t len)
+static const char _g_base64[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void base64_encode(char *dest, const uint8_t *src, uint8_t len)
 {
-    uint16_t dest = addr;
-    eeprom_read_block(bytes, (void *)dest, len);
+    uint8_t i;
+
+    for (i = 0; i < len; i += 3)
+    {
+        uint32_t block = (uint32_t)src[i] << 16;
+
+        if ((i + 1) < len)
+            block |= (uint16_t)src[i + 1] << 8;
+        if ((i + 2) < len)
+            block |= src[i + 2];
+
+        *dest++ = pgm_read_byte(&_g_base64[(block >> 18) & 0x3F]);
+        *dest++ = pgm_read_byte(&_g_base64[(block >> 12) & 0x3F]);
+        *dest++ = ((i + 1) < len) ? pgm_read_byte(&_g_base64[(block >> 6) & 0x3F]) : '=';
+        *dest++ = ((i + 2) < len) ? pgm_read_byte(&_g_base64[block & 0x3F]) : '=';
+    }
+
+    *dest = 0;
 }
+
+void bitset_and(uint8_t *dest, const uint8_t *src, uint8_t bytes)
+{
+    while (bytes--)
+        dest[bytes] &= src[bytes];
+}
+
+void bitset_andnot(uint8_t *dest, const uint8_t *src, uint8_t bytes)
+{
+    while (bytes--)
+        dest[bytes] &= ~src[bytes];
+}
+
+void bitset_or(uint8_t *dest, const uint8_t *src, uint8_t bytes)
+{
+    while (bytes--)
+        dest[bytes] |= src[bytes];
+}
+
+bool bitset_empty(const uint8_t *set, uint8_t bytes)
+{
+    while (bytes--)
+    {
+        if (set[bytes])
+            return false;
+    }
+
+    return true;
+}
+
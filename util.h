@@ -23,10 +23,21 @@ void reset(void);
 char *csvfield(char *s, char **saveptr);
 bool match_phonenumber(const char *n1, const char *n2);
 void format_fixedpoint(char *buf, int16_t value, uint8_t type);
-void eeprom_read_data(uint8_t addr, uint8_t *bytes, uint8_t len);
-void eeprom_write_data(uint8_t addr, uint8_t *bytes, uint8_t len);
+int16_t temp_from_decicelsius(int16_t decicelsius);
+int16_t temp_to_decicelsius(int16_t temp);
+void format_hex(char *buf, const uint8_t *data, uint8_t len);
+void eeprom_read_data(uint16_t addr, uint8_t *bytes, uint16_t len);
+void eeprom_write_data(uint16_t addr, uint8_t *bytes, uint16_t len);
 char wdt_getch(void);
 void decode_ucs2(char *str);
+uint8_t varint_encode(uint8_t *dest, uint32_t value);
+uint8_t varint_encode_bits(uint8_t *dest, const uint8_t *set, uint8_t bits);
+uint32_t zigzag_encode(int32_t value);
+void base64_encode(char *dest, const uint8_t *src, uint8_t len);
+void bitset_and(uint8_t *dest, const uint8_t *src, uint8_t bytes);
+void bitset_andnot(uint8_t *dest, const uint8_t *src, uint8_t bytes);
+void bitset_or(uint8_t *dest, const uint8_t *src, uint8_t bytes);
+bool bitset_empty(const uint8_t *set, uint8_t bytes);
 void putch(char byte);
 int print_char(char byte, FILE *stream);
 
@@ -55,11 +66,26 @@ int print_char(char byte, FILE *stream);
 
 #define format_i16_1dp(buf, value) format_fixedpoint(buf, (int16_t)value, I_1DP)
 #define format_u16_1dp(buf, value) format_fixedpoint(buf, (int16_t)value, U_1DP)
+#define format_temp(buf, value) format_i16_1dp(buf, temp_to_decicelsius(value))
 
 #define fixedpoint_arg(value, tag) tag##_sign, (abs(value) / _1DP_BASE), (abs(value) % _1DP_BASE)
 #define fixedpoint_arg_u(value) (value / _1DP_BASE), (value % _1DP_BASE)
 #define fixedpoint_arg_u_2dp(value) (value / _2DP_BASE), (value % _2DP_BASE)
 
+/* Temperatures are held in the sensors' native 1/16 degrees C */
+#define TEMP_FRAC_BITS      4
+#define TEMP_ONE            (1 << TEMP_FRAC_BITS)
+#define TEMP_DEGREES(d)     ((int16_t)(d) * TEMP_ONE)
+
+/* Bit sets of any size, held in a uint8_t array of BITSET_BYTES(bits) */
+#define BITSET_BYTES(bits)      (((bits) + 7) / 8)
+#define bitset_set(set, bit)    ((set)[(bit) / 8] |= (1 << ((bit) % 8)))
+#define bitset_clr(set, bit)    ((set)[(bit) / 8] &= ~(1 << ((bit) % 8)))
+#define bitset_test(set, bit)   (((set)[(bit) / 8] & (1 << ((bit) % 8))) != 0)
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
 #define max_(x, y) (x > y ? x : y)
 #define min_(x, y) (x < y ? x : y)
 